@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+#include <opencv2/opencv.hpp>
+
+#include "texture.hpp"
+
+/**
+ * Benchmarks of the painting stages, run from the command line interface. The kernel benchmark
+ * lives with the kernels (see Simd::benchmark).
+*/
+namespace Benchmark {
+    /**
+     * Counts the data cache misses of the calling thread with Linux perf events. Counting is unavailable
+     * on other platforms and where perf events are not permitted (see /proc/sys/kernel/perf_event_paranoid).
+     *
+     * Only the L1 data cache and the last-level cache have portable perf events. The L2 cache needs
+     * CPU-specific raw events, so the last-level misses stand in for the misses that reach memory.
+    */
+    class CacheMissCounter {
+        private:
+            // Counters of the L1 data cache and last-level cache read misses (-1 if unavailable)
+            int l1_counter = -1;
+            int ll_counter = -1;
+
+        public:
+            CacheMissCounter();
+
+            ~CacheMissCounter();
+
+            CacheMissCounter(const CacheMissCounter &) = delete;
+            CacheMissCounter &operator=(const CacheMissCounter &) = delete;
+
+            bool is_available() const {
+                return this->l1_counter >= 0;
+            }
+
+            /**
+             * Resets the counters and starts counting
+            */
+            void start();
+
+            /**
+             * Stops counting.
+             *
+             * @return: L1 data cache and last-level cache read misses since start (0 if unavailable)
+            */
+            std::pair<uint64_t, uint64_t> stop();
+    };
+
+    /**
+     * Compares the stroke orders on an image. The image is painted once and its strokes are
+     * recorded. Then the strokes of each layer are reordered in every stroke order and rendered
+     * again. Every order renders the same strokes, and only the rasterization (compositing onto the
+     * canvas and height map) is timed, not the tracing. The results are printed.
+     *
+     * @param input_image: Image to paint
+     * @param brushes: Height and opacity textures for the brush strokes
+    */
+    void stroke_orders(const cv::Mat &input_image, const std::shared_ptr<const BrushTextures> &brushes);
+}
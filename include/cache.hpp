@@ -0,0 +1,235 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+#include <Eigen/Eigen>
+
+#include "image.hpp"
+#include "importance.hpp"
+#include "kernel.hpp"
+#include "light.hpp"
+#include "stroke.hpp"
+#include "texture.hpp"
+
+using namespace Eigen;
+
+/**
+ * Incremental 64-bit FNV-1a hash used to compute cache keys.
+*/
+class Hasher {
+    private:
+        uint64_t hash = 14695981039346656037ull;
+
+    public:
+        void add(const void *data, const size_t len);
+
+        template <typename T>
+        void add(const T value) {
+            // Pointers and strings must be hashed by content (see the overloads)
+            static_assert(std::is_arithmetic<T>::value, "Only arithmetic values can be hashed by value");
+            this->add(&value, sizeof(T));
+        }
+
+        void add(const std::string &str);
+
+        void add(const Vector3f &vector);
+
+        /**
+         * Hashes the dimensions and pixels of an image (in any format)
+        */
+        void add(const cv::Mat &image);
+
+        /**
+         * Hashes the dimensions and pixels of a texture. Missing (nullptr) textures hash differently
+         * to every real texture
+        */
+        void add(const Texture *texture);
+
+        /**
+         * Hashes the dimensions and stored pixels of an image
+        */
+        void add(const RGBImage *image);
+
+        /**
+         * Hashes the dimensions and pixels of a gray-scale image
+        */
+        void add(const GrayImage *image);
+
+        /**
+         * Hashes the source and strength of the importance (and the mask, if any). Disabled 
+         * importances hash the same, whatever their strength
+        */
+        void add(const Importance &importance);
+
+        uint64_t get_hash() const {
+            return this->hash;
+        }
+
+        /**
+         * @return: Hexadecimal representation of the hash
+        */
+        std::string get_key() const;
+};
+
+/**
+ * Cache key functions. Every key changes whenever anything the cached result depends on changes,
+ * so cached results never go stale and can be shared between runs and processes.
+*/
+namespace CacheKey {
+    /**
+     * @param source_image: Input image (BGR)
+     * @param stroke_order: Order the strokes are rendered in
+     * @param importance: Importance of the pixels
+     *
+     * @return: Key of the strokes of a painting. Stroke tracing does not depend on the brush
+     *          stroke textures, so only the input pixels and the painting parameters are hashed
+    */
+    std::string strokes(const cv::Mat &source_image, const StrokeOrder stroke_order, const Importance &importance);
+
+    /**
+     * @param source_image: Input image (BGR)
+     * @param height_texture: Height texture of the brush strokes
+     * @param opacity_texture: Opacity texture of the brush strokes
+     * @param stroke_order: Order the strokes are rendered in
+     * @param importance: Importance of the pixels
+     *
+     * @return: Key of a painting (its G-buffer). Hashes the input pixels, the brush stroke
+     *          textures and the painting parameters
+    */
+    std::string painting(const cv::Mat &source_image, const Texture *height_texture, const Texture *opacity_texture,
+                         const StrokeOrder stroke_order, const Importance &importance);
+
+    /**
+     * @param painting_key: Key of the painting
+     * @param shader: Name of the shader
+     * @param view_pos: View/eye position
+     * @param lights: Lights in the scene
+     * @param distant_lights: True if the distant-light approximation is used
+     *
+     * @return: Key of the textured image of a painting
+    */
+    std::string texture(const std::string &painting_key, const std::string &shader, const Vector3f &view_pos,
+                        const std::vector<Light> &lights, const bool distant_lights);
+
+    /**
+     * @param source_key: Key of the stored pixels of the image being blurred (see Hasher::add(const RGBImage *))
+     * @param kernel: Gaussian kernel
+     *
+     * @return: Key of a blurred reference image
+    */
+    std::string reference(const std::string &source_key, const GaussianKernel *kernel);
+}
+
+/**
+ * Content-addressed on-disk cache of intermediate and final results.
+ *
+ * Every entry is a single file named after its key (which includes an extension naming the kind
+ * of entry, e.g. "0123456789abcdef.gbuf"). Entries are written to a temporary file and renamed
+ * once complete, so concurrent processes never read partial entries. Once the total size of the
+ * entries exceeds the size cap, the least recently used entries are evicted. Recency is the
+ * modification time of an entry, refreshed on every hit, so it is shared between processes too.
+ *
+ * The total size is tracked in memory between scans of the directory (an entry that replaces an 
+ * existing file only adds the difference). The directory is scanned on the first commit, when the 
+ * total exceeds the cap, and every 64 commits or 30 seconds, so that entries committed by other 
+ * processes sharing the directory are counted against the cap. Eviction frees an extra tenth of 
+ * the cap, so a full cache is not rescanned on every commit.
+*/
+class Cache {
+    private:
+        std::string directory;
+        uintmax_t max_bytes;
+
+        // Serialises eviction between the threads of this process
+        std::mutex mutex;
+        // Total size of the entries as of the last scan, plus the entries committed since
+        uintmax_t total_bytes = 0;
+        bool scanned = false;
+        std::chrono::steady_clock::time_point last_scan;
+        int commits_since_scan = 0;
+        // Names the temporary files of this instance (random, so that processes sharing the directory differ)
+        uint32_t instance_id;
+        std::atomic<int> next_write;
+
+        /**
+         * Counts a committed entry and, if the cache may have outgrown its size cap or is due for 
+         * a rescan, scans the directory and evicts the least recently used entries until the cache 
+         * fits again.
+         *
+         * @param keep: Key of the committed entry, which must not be evicted
+         * @param size: Size of the committed entry
+         * @param replaced: Size of the entry it replaced (0 if there was none)
+        */
+        void evict(const std::string &keep, const uintmax_t size, const uintmax_t replaced);
+
+    public:
+        /**
+         * Constructor for Cache. Creates the directory if it does not exist.
+         *
+         * @param directory: Directory of the cache, with a trailing separator
+         * @param max_bytes: Size cap of the cache
+        */
+        Cache(const std::string &directory, const uintmax_t max_bytes);
+
+        /**
+         * @param key: Key of the entry
+         *
+         * @return: Path of the entry
+        */
+        std::string get_path(const std::string &key) const;
+
+        /**
+         * Looks an entry up and marks it as recently used.
+         *
+         * @param key: Key of the entry
+         *
+         * @return: True if the entry exists
+        */
+        bool lookup(const std::string &key);
+
+        /**
+         * @param key: Key of the entry to write
+         *
+         * @return: Temporary path to write the entry to. The entry becomes visible once it is committed
+        */
+        std::string get_write_path(const std::string &key);
+
+        /**
+         * Publishes an entry written to a temporary path and evicts entries if the cache is full.
+         *
+         * @param key: Key of the entry
+         * @param write_path: Path returned by get_write_path
+         * @param written: False if writing failed, in which case the temporary file is removed
+         *
+         * @return: True if the entry was published
+        */
+        bool commit(const std::string &key, const std::string &write_path, const bool written);
+
+        /**
+         * Stores an image. Pixels are written exactly as they are stored in memory (column-major,
+         * after a fixed-size header), so the entry can be memory-mapped and loads without conversion.
+         *
+         * @param key: Key of the entry
+         * @param image: Image to store
+         *
+         * @return: True if the image was stored
+        */
+        bool save_image(const std::string &key, const RGBImage *image);
+
+        /**
+         * @param key: Key of the entry
+         * @param width: Expected width of the image
+         * @param height: Expected height of the image
+         *
+         * @return: The stored image, or nullptr if it is not cached (or was stored with a different
+         *          pixel storage precision). The image must be freed
+        */
+        RGBImage *load_image(const std::string &key, const int width, const int height);
+};
@@ -0,0 +1,209 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <Eigen/Eigen>
+
+#include "light.hpp"
+#include "paint.hpp"
+#include "parallel.hpp"
+#include "shader.hpp"
+#include "texture.hpp"
+
+using namespace Eigen;
+
+/**
+ * Embedding interface of the fast-paint-texture library.
+ *
+ * Images are passed as raw pixel buffers in caller-owned memory, so painting does not touch
+ * the filesystem. Every function is reentrant: concurrent calls only share the read-only
+ * brush textures and the process-wide thread pool (see Parallel). Parallel::configure and
+ * Simd::select must not be called while a painting is running.
+*/
+namespace FastPaintAPI {
+    /**
+     * Layout of a single pixel. Alpha channels are ignored on input and set to 255 on output.
+    */
+    enum class PixelFormat {
+        GRAY8,
+        RGB8,
+        BGR8,
+        RGBA8,
+        BGRA8
+    };
+
+    /**
+     * @param format: Pixel format
+     *
+     * @return: Number of bytes per pixel
+    */
+    int get_bytes_per_pixel(const PixelFormat format);
+
+    /**
+     * Read-only pixels in caller-owned memory.
+    */
+    struct ImageView {
+        const uint8_t *data;
+        int width, height;
+        // Bytes from the start of a row to the start of the next row
+        size_t stride;
+        PixelFormat format;
+    };
+
+    /**
+     * Writable pixels in caller-owned memory.
+    */
+    struct ImageBuffer {
+        uint8_t *data;
+        int width, height;
+        // Bytes from the start of a row to the start of the next row
+        size_t stride;
+        PixelFormat format;
+    };
+
+    /**
+     * Options of a single painting
+    */
+    struct PaintOptions {
+        // Shader used for the textured output: blinn-phong, lambertian, oren-nayar, toon or normal
+        std::string shader = "blinn-phong";
+        // Lights and view position. The defaults of FastPaintTexture are used if they are not provided
+        std::vector<Light> lights;
+        Vector3f view_pos = Vector3f::Zero();
+        bool view_provided = false;
+        // Shade with a normal-indexed lookup table (see ShadingTable)
+        bool distant_lights = false;
+        // Time and stroke budget (unlimited by default)
+        PaintBudget budget;
+        // How the stroke seeds of each layer are found (every placement finds the same seeds)
+        StrokePlacement stroke_placement = StrokePlacement::QUADTREE;
+        // Importance of the pixels (disabled by default). Masks must have the dimensions of the input (see create_importance_mask)
+        Importance importance;
+        // Order the strokes of each layer are rendered in (ignored by budgeted paintings)
+        StrokeOrder stroke_order = StrokeOrder::RASTER;
+    };
+
+    /**
+     * Creates brush textures from gray-scale buffers. The pixels are copied.
+     *
+     * @param height_texture: Height texture of the brush strokes (GRAY8)
+     * @param opacity_texture: Opacity texture of the brush strokes (GRAY8)
+     *
+     * @return: Brush textures that can be shared by any number of paintings
+     *
+     * @throws std::invalid_argument: If a buffer is not a valid GRAY8 image
+    */
+    std::shared_ptr<const BrushTextures> create_brushes(const ImageView &height_texture, const ImageView &opacity_texture);
+
+    /**
+     * Creates an importance mask from a gray-scale buffer. The pixels are copied.
+     *
+     * @param mask: Importance of every pixel (GRAY8, 0 is unimportant and 255 is important)
+     * @param width: Width of the images the mask is used for
+     * @param height: Height of the images the mask is used for
+     *
+     * @return: The mask, resized to width x height. It can be shared by any number of paintings
+     *
+     * @throws std::invalid_argument: If the buffer is not a valid GRAY8 image
+    */
+    std::shared_ptr<const GrayImage> create_importance_mask(const ImageView &mask, const int width, const int height);
+
+    /**
+     * @param name: Name of the shader (blinn-phong, lambertian, oren-nayar, toon or normal)
+     *
+     * @return: The shader, or nullptr if the name is unknown
+    */
+    std::unique_ptr<Shader> create_shader(const std::string &name);
+
+    /**
+     * Outcome of a painting job
+    */
+    enum class JobStatus {
+        COMPLETED,
+        CANCELLED
+    };
+
+    /**
+     * Handle of a painting running in the background (see paint_async).
+     *
+     * Destroying a job that is still running cancels it and waits until it has stopped, so the 
+     * output buffers are never written after the job is gone.
+    */
+    class PaintJob {
+        private:
+            std::shared_ptr<Parallel::CancellationToken> token;
+            std::shared_future<JobStatus> result;
+
+        public:
+            /**
+             * @param token: Token checked by the painting
+             * @param result: Status of the painting once it has finished
+            */
+            PaintJob(std::shared_ptr<Parallel::CancellationToken> token, std::shared_future<JobStatus> result);
+
+            ~PaintJob();
+
+            PaintJob(const PaintJob &) = delete;
+            PaintJob &operator=(const PaintJob &) = delete;
+
+            /**
+             * Asks the painting to stop. Returns immediately; the painting stops at its next 
+             * checkpoint (between strokes and tiles). The outputs of a cancelled job are undefined.
+            */
+            void cancel();
+
+            /**
+             * @param timeout: Maximum time to wait
+             *
+             * @return: True if the painting has finished (completed, cancelled or failed)
+            */
+            bool wait_for(std::chrono::milliseconds timeout) const;
+
+            /**
+             * Waits until the painting has finished.
+             *
+             * @return: COMPLETED if the outputs have been written, CANCELLED otherwise
+             *
+             * @throws: Any exception thrown by the painting
+            */
+            JobStatus wait() const;
+    };
+
+    /**
+     * Paints an image and textures the painting.
+     *
+     * @param input: Image to paint (any format)
+     * @param brushes: Brush textures
+     * @param options: Painting options
+     * @param texture: Output for the textured image (colour format, can be nullptr)
+     * @param paint: Output for the painted image (colour format, can be nullptr)
+     * @param height: Output for the height map (GRAY8, can be nullptr)
+     *
+     * @throws std::invalid_argument: If a buffer is invalid, an output or the importance mask does not
+     *                                have the dimensions of the input, or the shader is unknown
+    */
+    void paint(const ImageView &input, const std::shared_ptr<const BrushTextures> &brushes, const PaintOptions &options,
+               const ImageBuffer *texture, const ImageBuffer *paint, const ImageBuffer *height);
+
+    /**
+     * Paints an image in the background. Takes the same arguments as paint and validates them 
+     * before returning. The input pixels are copied, so the input buffer can be reused as soon as 
+     * paint_async returns, but the output buffers must stay valid until the job has finished.
+     *
+     * @param progress: Called on the job thread with the progress of the painting (can be empty)
+     * @param progress_interval: Number of strokes between progress reports within a layer (0 for layers only)
+     *
+     * @return: Handle of the job
+     *
+     * @throws std::invalid_argument: Same as paint
+    */
+    std::unique_ptr<PaintJob> paint_async(const ImageView &input, const std::shared_ptr<const BrushTextures> &brushes,
+                                          const PaintOptions &options, const ImageBuffer *texture, const ImageBuffer *paint,
+                                          const ImageBuffer *height, ProgressCallback progress, int progress_interval);
+}
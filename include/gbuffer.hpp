@@ -0,0 +1,40 @@
+#pragma once
+
+#include <string>
+#include <tuple>
+
+#include <opencv2/opencv.hpp>
+
+#include "image.hpp"
+
+/**
+ * Geometry buffer (G-buffer) utility functions.
+ *
+ * A G-buffer stores everything FastPaintTexture::texture needs (the painted albedo canvas
+ * and the height map) so that a painted image can be relit without being repainted. G-buffers are
+ * stored in the Cache, keyed by CacheKey::painting.
+*/
+namespace GBuffer {
+    /**
+     * Writes a G-buffer to disk.
+     *
+     * @param path: Path of the G-buffer file
+     * @param albedo: Painted (unshaded) canvas
+     * @param height_map: Height map of the painted canvas
+     *
+     * @return: True if the G-buffer was written successfully
+    */
+    bool save(const std::string &path, const RGBImage *albedo, const GrayImage *height_map);
+
+    /**
+     * Reads a G-buffer from disk.
+     *
+     * @param path: Path of the G-buffer file
+     * @param width: Expected width of the painting
+     * @param height: Expected height of the painting
+     *
+     * @return: Tuple containing the albedo canvas and height map. Both are nullptr if the
+     *          G-buffer does not exist or is invalid. Otherwise both must be freed.
+    */
+    std::tuple<RGBImage*, GrayImage*> load(const std::string &path, const int width, const int height);
+}
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <vector>
+
 #include <opencv2/opencv.hpp>
 #include <Eigen/Eigen>
 
@@ -7,15 +9,73 @@
 
 using namespace Eigen;
 
+/**
+ * Pixel storage precision. 
+ * 
+ * All arithmetic is done in single precision. The storage types only decide how pixels are
+ * kept in memory, so the compact modes trade a bounded rounding error for memory traffic:
+ *  - PRECISION_UINT8: 8-bit colour channels (3 bytes per RGB pixel)
+ *  - PRECISION_UINT16: 8.8 fixed-point colour channels (6 bytes per RGB pixel)
+ *  - Default: single precision colour channels (12 bytes per RGB pixel)
+*/
+#if defined(PRECISION_UINT8)
+    typedef Matrix<uint8_t, 3, 1> ColourStorage;
+#elif defined(PRECISION_UINT16)
+    typedef Matrix<uint16_t, 3, 1> ColourStorage;
+#else
+    typedef Vector3f ColourStorage;
+#endif
+
+/**
+ * Gray-scale images (height map, differences, luminosity) are single precision in every mode. 
+ * Every stroke raises the height map by 0.001 more than the previous one (so later strokes 
+ * lie on top), and these offsets grow with the stroke count. Half precision has a step of 
+ * 0.125 at heights near 255 (and 0.0625 from 64), so the offsets of thousands of consecutive 
+ * strokes would round to the same value and the stroke order would be lost.
+*/
+typedef float GrayStorage;
+
 // Eigen matrix for storing RGB (3-channel images)
-typedef Matrix<Vector3f, Dynamic, Dynamic> RGBMatrix;
+typedef Matrix<ColourStorage, Dynamic, Dynamic> RGBMatrix;
 // Eigen matrix for storing gray-scale (single channel images)
-typedef Matrix<float, Dynamic, Dynamic> GrayMatrix;
+typedef Matrix<GrayStorage, Dynamic, Dynamic> GrayMatrix;
+// Eigen matrix for storing vector fields (e.g. normals). Always single precision
+typedef Matrix<Vector3f, Dynamic, Dynamic> VectorMatrix;
 
 /**
  * Image utility functions not associated to a object.
 */
 namespace ImageUtil {
+    /**
+     * @param colour: Stored colour
+     * 
+     * @return: Colour widened to single precision
+    */
+    inline Vector3f load_colour(const ColourStorage &colour) {
+        #if defined(PRECISION_UINT8)
+            return colour.cast<float>();
+        #elif defined(PRECISION_UINT16)
+            return colour.cast<float>() * (1.0f / 256.0f);
+        #else
+            return colour;
+        #endif
+    }
+
+    /**
+     * @param colour: Single precision colour
+     * 
+     * @return: Colour rounded to the storage precision
+    */
+    inline ColourStorage store_colour(const Vector3f &colour) {
+        #if defined(PRECISION_UINT8)
+            return (colour.cwiseMax(0.0f).cwiseMin(255.0f).array() + 0.5f).cast<uint8_t>();
+        #elif defined(PRECISION_UINT16)
+            return (colour.cwiseMax(0.0f).cwiseMin(65535.0f / 256.0f).array() * 256.0f + 0.5f).cast<uint16_t>();
+        #else
+            return colour;
+        #endif
+    }
+
     /**
      * @param image: Gray-scale matrix
      * @param x: x-coordinate
@@ -23,7 +83,10 @@ namespace ImageUtil {
      * 
      * @return: Pixel at (x, y)
     */
-    float get_pixel(const GrayMatrix *image, const int x, const int y);
+    inline float get_pixel(const GrayMatrix *image, const int x, const int y) {
+        // Eigen uses (row, col) indicies
+        return static_cast<float>((*image)(y, x));
+    }
 
     /**
      * @param image: Gray-scale matrix
@@ -31,7 +94,9 @@ namespace ImageUtil {
      * @param y: y-coordiante
      * @param colour: colour to set
     */
-    void set_pixel(GrayMatrix *image, const int x, const int y, const float colour);
+    inline void set_pixel(GrayMatrix *image, const int x, const int y, const float colour) {
+        (*image)(y, x) = static_cast<GrayStorage>(colour);
+    }
     
     /**
      * @param image: Gray-scale matrix
@@ -40,7 +105,9 @@ namespace ImageUtil {
      * 
      * @return: Pixel at (x, y)
     */
-    Vector3f get_pixel(const RGBMatrix *image, const int x, const int y);
+    inline Vector3f get_pixel(const RGBMatrix *image, const int x, const int y) {
+        return load_colour((*image)(y, x));
+    }
 
     /**
      * @param image: Gray-scale matrix
@@ -48,7 +115,9 @@ namespace ImageUtil {
      * @param y: y-coordiante
      * @param colour: colour to set
     */
-    void set_pixel(RGBMatrix *image, const int x, const int y, const Vector3f colour);
+    inline void set_pixel(RGBMatrix *image, const int x, const int y, const Vector3f colour) {
+        (*image)(y, x) = store_colour(colour);
+    }
 
     /**
      * @param c1: first colour to blend
@@ -161,6 +230,16 @@ class GrayImage {
         */
         cv::Mat *to_cv_mat();
 
+        /**
+         * @param x: x-coordinate 
+         * @param y: y-coordinate
+         * @param sobel_x: Horizontal sobel kernel
+         * @param sobel_y: Vertical sobel kernel
+         * 
+         * @return: Unnormalised gradient (gx, gy) of the image at the given point
+        */
+        Vector2f convolve_sobel(const int x, const int y, const HorizontalSobelKernel *sobel_x, const VerticalSobelKernel *sobel_y) const;
+
         /**
          * Computes the gradient of the image at the given point
          * 
@@ -173,13 +252,69 @@ class GrayImage {
         */
         std::tuple<Vector2f, float> compute_gradient(const int x, const int y, const HorizontalSobelKernel *sobel_x, const VerticalSobelKernel *sobel_y);
 
+        /**
+         * Computes the gradient of every pixel (see compute_gradient) in parallel.
+         * 
+         * @param sobel_x: Horizontal sobel kernel
+         * @param sobel_y: Vertical sobel kernel
+         * 
+         * @return: Matrix containing (gx, gy, magnitude) of every pixel. This matrix must be freed
+        */
+        VectorMatrix *compute_gradients(const HorizontalSobelKernel *sobel_x, const VerticalSobelKernel *sobel_y);
+
         /**
          * @param sobel_x: Horiozntal sobel kernel
          * @param sobel_y: Vertical sobel kernel
          * 
-         * @return: RGB image containing the normal vectors of every pixel in the gray image
+         * @return: Matrix containing the normal vectors of every pixel in the gray image. This matrix must be freed
+        */
+        VectorMatrix *compute_normals(const HorizontalSobelKernel *sobel_x, const VerticalSobelKernel *sobel_y);
+
+        /**
+         * Computes the magnitude of the unnormalised gradient (see convolve_sobel) of every pixel in parallel.
+         * 
+         * @param sobel_x: Horizontal sobel kernel
+         * @param sobel_y: Vertical sobel kernel
+         * 
+         * @return: Image of the gradient magnitudes. This image must be freed
+        */
+        GrayImage *compute_edges(const HorizontalSobelKernel *sobel_x, const VerticalSobelKernel *sobel_y) const;
+};
+
+/**
+ * Summed-area table of a gray-scale image. Gives the sum of the pixels of any rectangle in constant time.
+*/
+class SummedAreaTable {
+    private:
+        // Dimensions of the image
+        int width = 0, height = 0;
+        // (height + 1) x (width + 1) column-major table. Entry (x, y) is the sum of the pixels above
+        // and to the left of (x, y). Sums are kept in double precision, so they stay exact enough for 
+        // whole images
+        std::vector<double> sums;
+
+        double get_entry(const int x, const int y) const {
+            return this->sums[(size_t) x * (this->height + 1) + y];
+        }
+
+    public:
+        /**
+         * Computes the table of an image in parallel. The memory of the table is reused (and only 
+         * grows) across images.
+         * 
+         * @param image: Image to sum
+        */
+        void compute(const GrayImage *image);
+
+        /**
+         * @param x_begin: First column of the rectangle
+         * @param y_begin: First row of the rectangle
+         * @param x_end: Column after the last column of the rectangle
+         * @param y_end: Row after the last row of the rectangle
+         * 
+         * @return: Sum of the pixels of the rectangle. The rectangle is clipped to the image
         */
-        RGBImage *compute_normals(const HorizontalSobelKernel *sobel_x, const VerticalSobelKernel *sobel_y);
+        double get_sum(int x_begin, int y_begin, int x_end, int y_end) const;
 };
 
 /**
@@ -297,10 +432,20 @@ class RGBImage {
         RGBImage *gaussian_blur(const GaussianKernel *kernel);
 
         /**
-         * @return: The average pixel colour of the image
+         * @return: The average pixel colour of the image. Accumulated in double precision
         */
         Vector3f average_colour();
 
+        /**
+         * Computes the per-pixel difference to compare_image and the luminosity of the image 
+         * in a single parallel pass over both images. Either output can be omitted.
+         * 
+         * @param compare_image: Image to compare against (e.g. the canvas). Only read if differences is provided
+         * @param differences: Output image for the distance between each pair of pixels (can be nullptr)
+         * @param luminosity: Output image for the luminosity of each pixel (can be nullptr)
+        */
+        void preprocess(const RGBImage *compare_image, GrayImage *differences, GrayImage *luminosity) const;
+
         /**
          * Computes the difference between the image and the compare_image
          * 
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <memory>
+
+#include <opencv2/opencv.hpp>
+
+#include "image.hpp"
+
+/**
+ * Where the importance of the pixels of a painting comes from
+*/
+enum class ImportanceSource {
+    // Every pixel is equally important
+    NONE,
+    // Edges of the blurred luminosity of each layer (see ProgramParameters::edge_importance)
+    EDGES,
+    // Gray-scale mask with the dimensions of the image (0 is unimportant, 255 is important)
+    MASK
+};
+
+/**
+ * Importance of the pixels of a painting.
+ *
+ * Every layer except the coarsest judges a grid cell against the error threshold scaled by
+ * 1 + strength * (1 - m), where m (between 0 and 1) is the importance of the seed of the cell,
+ * so the fine brushes are only used where detail matters. The coarsest layer covers the canvas, 
+ * so its threshold is only scaled if it is the only layer.
+*/
+struct Importance {
+    ImportanceSource source = ImportanceSource::NONE;
+    // Threshold scale of the least important pixels, minus one
+    float strength = 4.0f;
+    // Importance of every pixel (MASK only)
+    std::shared_ptr<const GrayImage> mask;
+
+    bool is_enabled() const {
+        return this->source != ImportanceSource::NONE;
+    }
+
+    /**
+     * @param x: x-coordinate of the pixel
+     * @param y: y-coordinate of the pixel
+     * @param edges: Gradient magnitudes of the blurred luminosity of the layer (only used by EDGES)
+     *
+     * @return: Factor the error threshold is scaled by at (x, y)
+    */
+    float get_threshold_scale(const int x, const int y, const GrayImage *edges) const;
+
+    /**
+     * Creates an importance mask from a gray-scale image.
+     *
+     * @param image: Single-channel 8-bit image (0 is unimportant, 255 is important)
+     * @param width: Width of the image being painted
+     * @param height: Height of the image being painted
+     *
+     * @return: The mask, resized to the image being painted
+     *
+     * @throws std::invalid_argument: If the image is empty or not single-channel 8-bit
+    */
+    static std::shared_ptr<const GrayImage> create_mask(const cv::Mat &image, const int width, const int height);
+};
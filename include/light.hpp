@@ -1,5 +1,7 @@
 #pragma once 
 
+#include <vector>
+
 #include <Eigen/Eigen>
 
 using namespace Eigen;
@@ -11,11 +13,14 @@ class Light {
     private:
         Vector3f position;
         Vector3f intensity;
+        // Distance beyond which the light has no effect (0 for unlimited range)
+        float range;
 
     public:
-        Light(Vector3f position, Vector3f intensity) {
+        Light(Vector3f position, Vector3f intensity, float range = 0.0f) {
             this->position = position;
             this->intensity = intensity;
+            this->range = range;
         }
 
         inline Vector3f get_position() const {
@@ -25,4 +30,70 @@ class Light {
         inline Vector3f get_intensity() const {
             return this->intensity;
         }
-};
\ No newline at end of file
+
+        inline float get_range() const {
+            return this->range;
+        }
+
+        /**
+         * Smooth range fall-off (1 - d^2 / range^2)^2. It is 1 at the light and reaches 0 (with a 
+         * zero slope) at the range, so lights beyond their range can be skipped without seams.
+         * 
+         * @param pos: Position being lit
+         * 
+         * @return: Attenuation of the light at pos in [0, 1]. Always 1 for lights with unlimited range
+        */
+        inline float get_attenuation(const Vector3f &pos) const {
+            if (this->range <= 0.0f) {
+                return 1.0f;
+            }
+            float falloff = 1.0f - (this->position - pos).squaredNorm() / (this->range * this->range);
+            return falloff > 0.0f ? falloff * falloff : 0.0f;
+        }
+};
+
+/**
+ * Per-tile light lists for shading an image (tiled light culling).
+ * 
+ * The image (on the z = 0 plane) is split into square tiles and each tile only keeps the lights 
+ * whose range reaches it. Shading a pixel then only visits the lights of its tile, so the cost per 
+ * pixel depends on how many lights overlap the pixel rather than on the number of lights in the scene.
+*/
+class LightGrid {
+    private:
+        int tile_size;
+        int tiles_x, tiles_y;
+        int num_scene_lights;
+
+        // Lights of each tile (row-major)
+        std::vector<std::vector<Light>> tiles;
+
+    public:
+        /**
+         * Constructor for LightGrid. Builds the light list of every tile.
+         * 
+         * @param lights: Lights in the scene
+         * @param width: width of the image
+         * @param height: height of the image
+         * @param tile_size: width and height of the tiles in pixels
+        */
+        LightGrid(const std::vector<Light> &lights, int width, int height, int tile_size);
+
+        int get_tile_size() const {
+            return this->tile_size;
+        }
+
+        int get_num_scene_lights() const {
+            return this->num_scene_lights;
+        }
+
+        /**
+         * @param x: x-coordinate of a pixel
+         * @param y: y-coordinate of a pixel
+         * 
+         * @return: The lights that can reach the tile containing (x, y)
+        */
+        const std::vector<Light> &get_lights(const int x, const int y) const {
+            return this->tiles[(y / this->tile_size) * this->tiles_x + (x / this->tile_size)];
+        }
+};
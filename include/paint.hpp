@@ -1,50 +1,322 @@
 #pragma once
 
+#include <chrono>
+#include <functional>
+#include <future>
+#include <memory>
+
 #include <Eigen/Eigen>
 
 #include "image.hpp"
+#include "importance.hpp"
 #include "stroke.hpp"
+#include "texture.hpp"
 #include "shader.hpp"
 #include "light.hpp"
+#include "strokelist.hpp"
+#include "parallel.hpp"
+#include "cache.hpp"
 
 using namespace Eigen;
 
+/**
+ * Called with a textured preview of the canvas while painting is in progress.
+ * 
+ * @param sequence: Number of previews published before this one
+ * @param layer: Index of the layer being painted (layers are painted from largest to smallest brush)
+ * @param preview: Textured preview. Owned by the caller of the callback and only valid during the call
+*/
+typedef std::function<void(int sequence, int layer, RGBImage *preview)> PreviewCallback;
+
+/**
+ * Progress of a painting in progress.
+*/
+struct PaintProgress {
+    // Index of the layer being painted and number of layers
+    int layer;
+    int num_layers;
+    // Strokes rendered in the current layer and strokes the layer will render at most
+    int layer_strokes;
+    int layer_total;
+    // Strokes rendered across all layers
+    int total_strokes;
+    // Seeds dropped as duplicates across all layers (see FastPaintTexture::get_duplicate_strokes)
+    int duplicate_strokes;
+    // Seeds dropped by the importance across all layers (see FastPaintTexture::get_unimportant_strokes)
+    int unimportant_strokes;
+};
+
+/**
+ * Called with the progress of a painting. Called on the painting thread, so it should return quickly.
+*/
+typedef std::function<void(const PaintProgress &progress)> ProgressCallback;
+
+/**
+ * Limits how much work a painting may do. A limit of 0 means unlimited. 
+ * 
+ * The budget covers painting (blurring, stroke placement, tracing and rendering) but not texturing. 
+ * Once the time budget is spent, no further layer is blurred or placed and the remaining error is 
+ * estimated instead of measured. A blur or difference pass that has already started runs to completion.
+*/
+struct PaintBudget {
+    // Wall-clock time (milliseconds)
+    double time_ms = 0.0;
+    // Number of strokes rendered across all layers
+    int strokes = 0;
+
+    bool is_limited() const {
+        return this->time_ms > 0.0 || this->strokes > 0;
+    }
+};
+
+/**
+ * How the stroke seeds of a layer are found.
+*/
+enum class StrokePlacement {
+    // Scan every cell of a uniform grid
+    GRID,
+    // Descend a quadtree over the difference image and only scan the cells of nodes with enough 
+    // error to hold a seed. Finds exactly the seeds GRID finds
+    QUADTREE
+};
+
 /**
  * The main painting class responsible for implementing the fast-paint-texture algorithm
 */
 class FastPaintTexture {
     private:
+        /**
+         * Candidate stroke position found by scanning the grid of a layer.
+        */
+        struct StrokeSeed {
+            int x, y;
+            // Sum of the differences in the grid cell of the seed
+            float area_error;
+        };
+
+        /**
+         * Everything a layer needs from the source image. It does not depend on the canvas, so 
+         * the reference of the next layer is prepared while the current layer is painted.
+        */
+        struct LayerReference {
+            // Blurred source image
+            RGBImage *ref_image;
+            // Gradients of the luminosity of the blurred image (see GrayImage::compute_gradients)
+            VectorMatrix *gradients;
+            // Gradient magnitudes of the luminosity of the blurred image (only computed for edge importance, nullptr otherwise)
+            GrayImage *edges;
+        };
+
         // Dimensions of the image
         int width, height;
 
         RGBImage *source_image;
 
-        // Arrays used for stroke drawing 
-        int *counters = nullptr;
-        Vector3f *old_colours = nullptr;
-        float *total_mask = nullptr;
-
+        // Number of strokes rendered by the current painting
         int cur_counter = 0;
         Vector3f cur_colour; 
 
-        // Textures
-        Texture *height_texture;
-        Texture *opacity_texture;
+        // Layer being painted
+        int cur_layer = 0;
+
+        /**
+         * Pixels of a brush mask column waiting to be blended (see Simd::KernelTable::composite)
+        */
+        struct CompositeBatch {
+            std::vector<int> rows;
+            std::vector<float> alphas, opacities, stroke_heights, colours, heights;
+
+            void resize(const int size) {
+                if (this->rows.size() < (size_t) size) {
+                    this->rows.resize(size);
+                    this->alphas.resize(size);
+                    this->opacities.resize(size);
+                    this->stroke_heights.resize(size);
+                    this->colours.resize(3 * size);
+                    this->heights.resize(size);
+                }
+            }
+        };
+
+        // Compositing scratch of the stroke being rendered
+        StrokeFootprint footprint;
+        CompositeBatch composite_batch;
+        // Limit curve of the stroke being rendered. Reused (and only grows) across strokes
+        std::vector<Vector2f> limit;
+
+        // Height and opacity textures of the brush strokes. Shared with other paintings
+        std::shared_ptr<const BrushTextures> brushes;
+        const TextureSampler *sampler;
+
+        // Shade with a normal-indexed lookup table (lights and view evaluated from the image centre)
+        bool distant_lights = false;
+
+        // Records every rendered stroke if set
+        StrokeList *stroke_list = nullptr;
+
+        // Order the strokes of each layer are rendered in (unless the painting is budgeted)
+        StrokeOrder stroke_order = StrokeOrder::RASTER;
+
+        // How the stroke seeds of each layer are found
+        StrokePlacement stroke_placement = StrokePlacement::QUADTREE;
+        // Summed-area table of the differences of the layer being painted. Reused across layers
+        SummedAreaTable difference_table;
+
+        // Budget of the whole painting and of the layer being painted
+        PaintBudget budget;
+        std::chrono::steady_clock::time_point paint_start;
+        std::chrono::steady_clock::time_point layer_deadline;
+        int layer_stroke_limit = 0;
+        // Area error of the seeds skipped because the budget ran out
+        double skipped_error = 0.0;
+        int skipped_strokes = 0;
+        // Layers left unpainted because the budget was spent
+        int skipped_layers = 0;
+        // Differences of the last painted layer before it was painted, and the differences of the grid cells 
+        // around its rendered seeds. They estimate the remaining error when there is no time left to measure it
+        bool layer_measured = false;
+        double layer_error = 0.0;
+        double layer_rendered_error = 0.0;
+
+        // Seeds dropped because they (nearly) duplicate a seed of the same layer
+        int duplicate_strokes = 0;
+
+        // Scales the error threshold of the cells of every layer except the coarsest (unless it is the only one)
+        Importance importance;
+        // Seeds dropped because their cell did not exceed the scaled threshold
+        int unimportant_strokes = 0;
+
+        // Progressive output. Previews are textured on the scheduler while painting continues, one at a time
+        PreviewCallback preview_callback;
+        int preview_stroke_interval = 0;
+        int preview_sequence = 0;
+        Parallel::TaskHandle preview_task;
+
+        // Shading used by previews. Set by fast_paint_texture
+        Shader *preview_shader = nullptr;
+        Vector3f preview_view_pos;
+        std::vector<Light> preview_lights;
+
+        // Progress reporting
+        ProgressCallback progress_callback;
+        int progress_stroke_interval = 0;
+        PaintProgress progress;
+
+        // Checked between layers, strokes and tiles if set. Not owned
+        const Parallel::CancellationToken *cancellation = nullptr;
+
+        // Stores the blurred reference images if set. Not owned
+        Cache *cache = nullptr;
+
+        /**
+         * Prepares the reference of a layer. Called on a background thread while the previous layer is painted.
+         * 
+         * @param radius: Brush radius of the layer
+         * @param source_key: Key of the source image (only used if there is a cache)
+         * 
+         * @return: Reference of the layer. Its images must be freed. They are all nullptr if the time 
+         *          budget was spent before the layer was prepared
+        */
+        LayerReference prepare_layer(int radius, const std::string &source_key);
+
+        /**
+         * Blurs the source image, or loads the blurred image from the cache.
+         * 
+         * @param kernel: Gaussian kernel
+         * @param source_key: Key of the source image (only used if there is a cache)
+         * 
+         * @return: The blurred source image. This image must be freed
+        */
+        RGBImage *blur_source(GaussianKernel *kernel, const std::string &source_key);
+
+        /**
+         * Reports the progress if a progress callback is set.
+         * 
+         * @param layer_strokes: Strokes rendered in the current layer
+        */
+        void report_progress(int layer_strokes);
+
+        /**
+         * Publishes a textured preview of the canvas if progressive output is enabled. The canvas 
+         * and height map are copied, so painting can continue while the preview is textured. Only 
+         * one preview is textured at a time.
+         * 
+         * @param canvas: Canvas being painted
+         * @param height_map: Height map being painted
+         * @param wait: If a preview is still being textured, waits for it if true and drops this 
+         *              preview if false
+        */
+        void publish_preview(RGBImage *canvas, GrayImage *height_map, bool wait);
+
+        /**
+         * Waits until the last published preview has been delivered.
+        */
+        void wait_for_previews();
         
+        /**
+         * Finds the grid cells of a quadtree node that can hold a seed. A cell holds a seed if the 
+         * sum of the differences in its search window exceeds the threshold. Differences are never 
+         * negative, so a node whose (enlarged) area sums to less than that cannot hold one and is 
+         * skipped without being scanned. Every cell of a node with enough error for all of its cells 
+         * is scanned without descending further. Node sums come from difference_table.
+         * 
+         * @param grid: Grid spacing
+         * @param col_begin: First grid column of the node
+         * @param row_begin: First grid row of the node
+         * @param col_end: Grid column after the last column of the node
+         * @param row_end: Grid row after the last row of the node
+         * @param row_cells: Columns of the cells found in each grid row. Cells are appended in increasing column order
+        */
+        void find_seed_cells(int grid, int col_begin, int row_begin, int col_end, int row_end, 
+                             std::vector<std::vector<int>> &row_cells) const;
+
+        /**
+         * Drops seeds that duplicate an earlier seed of the layer. The search windows of neighbouring
+         * grid cells share their borders, so an error peak on a border is found by both cells, and
+         * peaks on either side of a border trace almost the same stroke. A seed is dropped if it lies
+         * within duplicate_fac * radius pixels (in both axes) of a seed that was kept. If that is 
+         * less than a pixel, only seeds at the position of a kept seed are dropped.
+         * 
+         * Kept seeds are bucketed by grid cell, so a seed is only compared with the kept seeds of 
+         * the cells within the tolerance.
+         * 
+         * @param seeds: Seeds of the layer in raster order. The remaining seeds keep their order
+         * @param radius: Radius of the brush stroke
+         * @param grid: Grid spacing of the layer
+         * 
+         * @return: Number of seeds dropped
+        */
+        int suppress_duplicates(std::vector<StrokeSeed> &seeds, int radius, int grid) const;
+
         /**
          * Paints a layer onto the canvas.
          * 
          * Implements the paintLayer psuedo-code from Painterly Rendering with Curved Brush 
-         * Strokes of Multiple Sizes by Aaron Hertzmann.
+         * Strokes of Multiple Sizes by Aaron Hertzmann. If the painting is budgeted, strokes are 
+         * traced and rendered in decreasing order of area error until the layer budget runs out.
          * 
-         * @param ref_image: Reference (target) image
+         * @param reference: Reference (target) image and its gradients
          * @param canvas: Canvas to paint the image onto
          * @param height_map: Height map of the image
          * @param radius: Radius of the brush stroke
+         * 
+         * @return: Number of strokes rendered (fewer if the painting is cancelled)
+        */
+        int paint_layer(const LayerReference &reference, RGBImage *canvas, GrayImage *height_map, int radius);
+
+        /**
+         * @param rendered: Number of strokes rendered in the current layer
+         * 
+         * @return: True if the budget of the current layer allows another stroke
         */
-        void paint_layer(RGBImage *ref_image, RGBImage *canvas, GrayImage *height_map, int radius);
+        bool within_layer_budget(int rendered) const;
 
-        float compose_height(float stroke_height, float stroke_opacity, float current_height);
+        /**
+         * @param rendered: Number of strokes rendered across all layers
+         * 
+         * @return: True if the budget of the painting allows another layer
+        */
+        bool within_budget(int rendered) const;
 
         /**
          * Renders a stroke onto the canvas and height map
@@ -88,43 +360,46 @@ class FastPaintTexture {
          * Implements the paint psuedo-code from Painterly Rendering with Curved Brush Strokes of Multiple Sizes by Aaron Hertzmann. 
          * However, it also renders to a height map which is used to perform shading.
          * 
-         * @return: Tuple containing the painted canvas and height map
+         * @return: Tuple containing the painted canvas and height map (both nullptr if the painting was cancelled)
         */
         std::tuple<RGBImage*, GrayImage*> paint();
-        
+
+    public:
         /**
-         * Textures a painted image using its height map. 
-         * 
-         * @param image: Painted image to texture
-         * @param height_map: Height map of the painted image
-         * @param shader: Shader to use for lighting
-         * @param view_pos: View/eye position
-         * @param lights: Lights in the scene
+         * Constructor for Paint.
          * 
-         * @return: The textured canvas
+         * @param width: The width of the rasterizer window.
+         * @param height: The height of the rasterizer window.
+         * @param source_image: The input image to be painted.
+         * @param brushes: Height and opacity textures for the brush strokes
         */
-        RGBImage *texture(RGBImage *image, GrayImage *height_map, Shader *shader, Vector3f view_pos, std::vector<Light> lights);
+        FastPaintTexture(int width, int height, cv::Mat source_image, std::shared_ptr<const BrushTextures> brushes);
 
-    public:
         /**
          * Constructor for Paint.
          * 
+         * @param source_image: The input image to be painted. The Paint takes ownership of the image
+         * @param brushes: Height and opacity textures for the brush strokes
+        */
+        FastPaintTexture(RGBImage *source_image, std::shared_ptr<const BrushTextures> brushes);
+
+        /**
+         * Constructor for a render-only Paint. It can only render stroke lists and texture 
+         * painted images, since there is no input image to paint.
+         * 
          * @param width: The width of the rasterizer window.
          * @param height: The height of the rasterizer window.
-         * @param source_image: The input image to be painted.
-         * @param height_texture: Height texture for the brush strokes
-         * @param opacity_texture: Opacity texture for the brush strokes
+         * @param brushes: Height and opacity textures for the brush strokes
         */
-        FastPaintTexture(int width, int height, cv::Mat source_image, Texture *height_texture, Texture *opacity_texture);
+        FastPaintTexture(int width, int height, std::shared_ptr<const BrushTextures> brushes);
 
         /**
          * Destructor for Paint.
         */
         ~FastPaintTexture() {
+            // The last preview still uses this painter if painting threw
+            Parallel::wait(this->preview_task);
             delete source_image;
-            delete[] counters;
-            delete[] old_colours;
-            delete[] total_mask;
         }
 
         RGBImage *get_source_image() {
@@ -132,9 +407,183 @@ class FastPaintTexture {
         }
 
         /**
-         * Implemented the Fast Paint Texture described by Aaron Hertzmann in Fast Paint Texture.
+         * Enables progressive output. A textured preview is published after every layer and, 
+         * optionally, every stroke_interval strokes. Previews are textured on the Parallel scheduler, 
+         * one at a time: a stroke preview is dropped while the previous preview is still being textured, 
+         * and a layer preview waits for it. fast_paint_texture only returns once the last preview has 
+         * been delivered.
          * 
+         * @param callback: Called with every preview
+         * @param stroke_interval: Number of strokes between previews within a layer (0 for layers only)
+        */
+        void set_preview_callback(PreviewCallback callback, int stroke_interval) {
+            this->preview_callback = callback;
+            this->preview_stroke_interval = stroke_interval;
+        }
+
+        /**
+         * Enables progress reporting. The progress is reported when a layer starts and ends and, 
+         * optionally, every stroke_interval strokes.
+         * 
+         * @param callback: Called with the progress
+         * @param stroke_interval: Number of strokes between reports within a layer (0 for layers only)
+        */
+        void set_progress_callback(ProgressCallback callback, int stroke_interval) {
+            this->progress_callback = callback;
+            this->progress_stroke_interval = stroke_interval;
+        }
+
+        /**
+         * Makes fast_paint_texture stop early once the token is cancelled. The token is checked 
+         * between layers, strokes and tiles, so the threads are freed shortly after cancelling.
+         * 
+         * @param token: Cancellation token (nullptr for none). Not owned, and must outlive the painting
+        */
+        void set_cancellation_token(const Parallel::CancellationToken *token) {
+            this->cancellation = token;
+        }
+
+        /**
+         * Caches the blurred reference image of every layer. They only depend on the input image 
+         * and the brush radius, so repeated paintings of the same image skip the blurring.
+         * 
+         * @param cache: Cache to use (nullptr for none). Not owned, and must outlive the painting
+        */
+        void set_cache(Cache *cache) {
+            this->cache = cache;
+        }
+
+        /**
+         * Enables the distant-light approximation for texturing. The light and view directions are 
+         * computed once from the centre of the image, so shading only depends on the normal and 
+         * the colour and is looked up in a ShadingTable.
+         * 
+         * @param distant_lights: True to use the approximation
+        */
+        void set_distant_lights(bool distant_lights) {
+            this->distant_lights = distant_lights;
+        }
+
+        /**
+         * Records every stroke rendered by fast_paint_texture into a stroke list. The list is 
+         * cleared and resized to the canvas when painting starts.
+         * 
+         * @param stroke_list: Stroke list to record into (nullptr to stop recording). Not owned
+        */
+        void set_stroke_list(StrokeList *stroke_list) {
+            this->stroke_list = stroke_list;
+        }
+
+        /**
+         * Sets how the stroke seeds of each layer are found. Every placement finds the same seeds.
+         * 
+         * @param stroke_placement: Stroke placement (quadtree by default)
+        */
+        void set_stroke_placement(StrokePlacement stroke_placement) {
+            this->stroke_placement = stroke_placement;
+        }
+
+        /**
+         * Sets the importance of the pixels. The fine brushes are only used where the differences 
+         * exceed the threshold scaled by the importance (see Importance).
+         * 
+         * @param importance: Importance of the pixels (disabled by default)
+         * 
+         * @throws std::invalid_argument: If the strength is negative, or the mask is missing or does 
+         *                                not have the dimensions of the image
+        */
+        void set_importance(const Importance &importance);
+
+        /**
+         * Sets the order the strokes of each layer are rendered in. Budgeted paintings ignore it 
+         * and render the strokes that reduce the most error first.
+         * 
+         * @param stroke_order: Order of the strokes (raster order by default)
+        */
+        void set_stroke_order(StrokeOrder stroke_order) {
+            this->stroke_order = stroke_order;
+        }
+
+        /**
+         * Limits the work done by fast_paint_texture. The budget is split evenly across the layers 
+         * that are left to paint, so whatever a layer does not use rolls over to the next ones. 
+         * Within a layer the strokes that reduce the most error are rendered first.
+         * 
+         * @param budget: Time and stroke budget (zero limits are unlimited)
+        */
+        void set_budget(PaintBudget budget) {
+            this->budget = budget;
+        }
+
+        /**
+         * @return: Number of seeds the last painting dropped as duplicates (see ProgramParameters::duplicate_fac)
+        */
+        int get_duplicate_strokes() const {
+            return this->duplicate_strokes;
+        }
+
+        /**
+         * @return: Number of seeds the last painting dropped because of the importance (see set_importance)
+        */
+        int get_unimportant_strokes() const {
+            return this->unimportant_strokes;
+        }
+
+        /**
+         * @return: The default lights. Four white lights placed above the quarter points of the image
+        */
+        std::vector<Light> get_default_lights() const;
+
+        /**
+         * @return: The default view/eye position. Centred above the image
+        */
+        Vector3f get_default_view_pos() const;
+
+        /**
+         * Textures a painted image using its height map.
+         *
+         * This is the only stage needed to relight a painting, so it can be called directly
+         * with a cached albedo canvas and height map (see GBuffer).
+         *
+         * @param image: Painted image to texture
+         * @param height_map: Height map of the painted image
+         * @param shader: Shader to use for lighting
+         * @param view_pos: View/eye position
+         * @param lights: Lights in the scene
+         *
+         * @return: The textured canvas
+        */
+        RGBImage *texture(RGBImage *image, GrayImage *height_map, Shader *shader, Vector3f view_pos, std::vector<Light> lights);
+
+        /**
+         * Renders a stroke list onto a new canvas and height map. The strokes are scaled from the 
+         * canvas they were painted on to the dimensions of this instance and textured with its 
+         * brush stroke textures, so no tracing is done.
+         * 
+         * @param stroke_list: Strokes to render
+         * 
+         * @return: Tuple containing the painted canvas and height map
+        */
+        std::tuple<RGBImage*, GrayImage*> render(const StrokeList *stroke_list);
+
+        /**
+         * Implemented the Fast Paint Texture described by Aaron Hertzmann in Fast Paint Texture.
+         *
+         * @param shader: Shader to use for lighting. If nullptr, the painting is not textured (and no previews are published)
+         * @param view_pos: View/eye position
+         * @param lights: Lights in the scene
+         *
+         * @return: Tuple containing the textured painted image (nullptr if shader is nullptr), painted image, and height map.
+         *          All three are nullptr if the painting was cancelled (see set_cancellation_token).
+        */
+        std::tuple<RGBImage*, RGBImage*, GrayImage*> fast_paint_texture(Shader *shader, Vector3f view_pos, std::vector<Light> lights);
+
+        /**
+         * Implemented the Fast Paint Texture using the default view position and lights.
+         *
          * @return: Tuple containing the textured painted image, painted image, and height map.
         */
-        std::tuple<RGBImage*, RGBImage*, GrayImage*> fast_paint_texture(Shader *shader);
+        std::tuple<RGBImage*, RGBImage*, GrayImage*> fast_paint_texture(Shader *shader) {
+            return this->fast_paint_texture(shader, this->get_default_view_pos(), this->get_default_lights());
+        }
 };
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <memory>
+
+/**
+ * Data-parallel utility functions shared by the image operations.
+ *
+ * Every parallel loop runs on one process-wide work-stealing scheduler. Each worker thread owns a
+ * deque of tasks: it takes its own tasks from the back and steals from the front of the other
+ * deques when it runs out. A thread waiting for a loop to finish runs queued tasks instead of
+ * blocking, so parallel loops can be nested (e.g. a loop over the images of a batch whose body
+ * blurs an image in parallel) without deadlocking or oversubscribing the cores.
+ *
+ * Loops can be cancelled cooperatively: a loop started inside a CancellationScope skips the chunks
+ * that have not started yet once its token is cancelled. Chunks that are running finish normally.
+*/
+namespace Parallel {
+    /**
+     * Flag used to cancel work cooperatively. It can be cancelled from any thread, and the work 
+     * checks it between chunks, tiles and strokes.
+    */
+    class CancellationToken {
+        private:
+            std::atomic<bool> cancelled;
+
+        public:
+            CancellationToken() : cancelled(false) {}
+
+            CancellationToken(const CancellationToken &) = delete;
+            CancellationToken &operator=(const CancellationToken &) = delete;
+
+            void cancel() {
+                this->cancelled = true;
+            }
+
+            bool is_cancelled() const {
+                return this->cancelled;
+            }
+    };
+
+    /**
+     * Associates a cancellation token with the calling thread while the scope is alive. Parallel
+     * loops started by the thread, and the loops nested in their bodies, check the token.
+    */
+    class CancellationScope {
+        private:
+            const CancellationToken *previous;
+
+        public:
+            /**
+             * @param token: Token to check (nullptr for none). Not owned
+            */
+            CancellationScope(const CancellationToken *token);
+
+            ~CancellationScope();
+
+            CancellationScope(const CancellationScope &) = delete;
+            CancellationScope &operator=(const CancellationScope &) = delete;
+    };
+
+    /**
+     * @return: True if the token of the calling thread (see CancellationScope) has been cancelled
+    */
+    bool is_cancelled();
+
+    /**
+     * Handle of a task started by run_async. An empty handle has no task and is always done.
+    */
+    class TaskHandle {
+        private:
+            std::shared_ptr<const std::atomic<bool>> done;
+
+        public:
+            TaskHandle() {}
+
+            TaskHandle(std::shared_ptr<const std::atomic<bool>> done) : done(done) {}
+
+            bool is_done() const {
+                return this->done == nullptr || *this->done;
+            }
+    };
+
+    /**
+     * Configures the scheduler. Must not be called while a parallel loop is running. The
+     * scheduler is restarted if it is already running.
+     *
+     * @param num_threads: Total number of threads running parallel loops, including the thread
+     *                     that starts a loop (0 for one per hardware thread)
+     * @param pin_threads: If true, worker i is pinned to core i (Linux only, ignored elsewhere)
+    */
+    void configure(const int num_threads, const bool pin_threads);
+
+    /**
+     * @return: Number of threads used for parallel loops
+    */
+    int get_num_threads();
+
+    /**
+     * @param begin: First index of the range
+     * @param end: One past the last index of the range
+     * @param grain: Maximum number of indices per chunk
+     *
+     * @return: Number of chunks parallel_for splits the range into
+    */
+    int get_num_chunks(const int begin, const int end, const int grain);
+
+    /**
+     * Splits [begin, end) into chunks of at most grain indices and runs body on the chunks in
+     * parallel. The chunks only depend on grain, so per-chunk results can be combined
+     * deterministically using the chunk index (chunk_begin - begin) / grain. If the loop is 
+     * cancelled (see CancellationScope), body is not called for the remaining chunks.
+     *
+     * @param begin: First index of the range
+     * @param end: One past the last index of the range
+     * @param grain: Maximum number of indices per chunk
+     * @param body: Function called as body(chunk_begin, chunk_end)
+    */
+    void parallel_for(const int begin, const int end, const int grain, const std::function<void(int, int)> &body);
+
+    /**
+     * Splits an image into tile_size x tile_size tiles and runs body on the tiles in parallel.
+     *
+     * @param width: width of the image
+     * @param height: height of the image
+     * @param tile_size: width and height of the tiles (tiles on the right and bottom edges can be smaller)
+     * @param body: Function called as body(x_begin, y_begin, x_end, y_end)
+    */
+    void parallel_for_tiles(const int width, const int height, const int tile_size,
+                            const std::function<void(int, int, int, int)> &body);
+
+    /**
+     * Queues a task on the scheduler and returns without waiting for it. The task is run by a 
+     * worker (or by a thread helping in a parallel loop or in wait), and its parallel loops are 
+     * nested loops of the scheduler. It is cancelled with the token of the calling thread (see 
+     * CancellationScope). With a single thread the task runs before run_async returns.
+     *
+     * @param task: Function to run
+     *
+     * @return: Handle of the task
+    */
+    TaskHandle run_async(const std::function<void()> &task);
+
+    /**
+     * Waits until a task has finished, running queued tasks in the meantime.
+     *
+     * @param handle: Handle of the task
+    */
+    void wait(const TaskHandle &handle);
+}
@@ -20,7 +20,9 @@ namespace ProgramParameters {
 
     const int threshold = 100;                      // How much error to allow before painting over
 
-    const float aa = 0.1f;                          // Size of the fall-off region for anti-alaising brush strokes
+    const float duplicate_fac = 0.25f;              // Seeds this close (relative to brush radius) to a painted seed are suppressed
+
+    const float edge_importance = 64.0f;            // Gradient magnitude of the blurred luminosity at which edges are fully important
 
-    const bool random_stroke_order = false;         // If true, randomise stroke order
+    const float aa = 0.1f;                          // Size of the fall-off region for anti-alaising brush strokes
 }
\ No newline at end of file
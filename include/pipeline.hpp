@@ -0,0 +1,121 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Thread-safe first-in first-out queue with a fixed capacity.
+ *
+ * Producers block while the queue is full, which applies backpressure to the stages in front
+ * of a slow stage instead of buffering an unbounded amount of work (e.g. decoded images).
+*/
+template <typename T>
+class BoundedQueue {
+    private:
+        size_t capacity;
+        std::deque<T> items;
+        // Set once no more items will be pushed
+        bool closed = false;
+
+        std::mutex mutex;
+        std::condition_variable not_empty;
+        std::condition_variable not_full;
+
+    public:
+        /**
+         * Constructor for BoundedQueue.
+         *
+         * @param capacity: Maximum number of queued items (at least 1)
+        */
+        BoundedQueue(size_t capacity) {
+            this->capacity = std::max(capacity, (size_t) 1);
+        }
+
+        /**
+         * Appends an item, waiting while the queue is full.
+         *
+         * @param item: Item to append
+         *
+         * @return: False if the queue was closed (the item is dropped)
+        */
+        bool push(T item) {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->not_full.wait(lock, [this]() { return this->items.size() < this->capacity || this->closed; });
+            if (this->closed) {
+                return false;
+            }
+            this->items.push_back(std::move(item));
+            this->not_empty.notify_one();
+            return true;
+        }
+
+        /**
+         * Removes the oldest item, waiting while the queue is empty.
+         *
+         * @param item: Output for the removed item
+         *
+         * @return: False if the queue is closed and empty
+        */
+        bool pop(T &item) {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->not_empty.wait(lock, [this]() { return !this->items.empty() || this->closed; });
+            if (this->items.empty()) {
+                return false;
+            }
+            item = std::move(this->items.front());
+            this->items.pop_front();
+            this->not_full.notify_one();
+            return true;
+        }
+
+        /**
+         * Stops accepting items. Queued items can still be popped.
+        */
+        void close() {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->closed = true;
+            this->not_empty.notify_all();
+            this->not_full.notify_all();
+        }
+};
+
+/**
+ * Fixed set of threads that all run the same function (e.g. a loop popping a BoundedQueue).
+*/
+class WorkerGroup {
+    private:
+        std::vector<std::thread> threads;
+
+    public:
+        /**
+         * Constructor for WorkerGroup. Starts the threads.
+         *
+         * @param num_threads: Number of threads
+         * @param body: Function run by every thread
+        */
+        WorkerGroup(int num_threads, const std::function<void()> &body) {
+            for (int i = 0; i < num_threads; i++) {
+                this->threads.push_back(std::thread(body));
+            }
+        }
+
+        ~WorkerGroup() {
+            this->join();
+        }
+
+        /**
+         * Waits until every thread has returned.
+        */
+        void join() {
+            for (std::thread &thread : this->threads) {
+                if (thread.joinable()) {
+                    thread.join();
+                }
+            }
+        }
+};
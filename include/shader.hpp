@@ -1,5 +1,8 @@
 #pragma once 
 
+#include <algorithm>
+#include <vector>
+
 #include <Eigen/Eigen>
 
 #include "light.hpp"
@@ -22,7 +25,26 @@ class Shader {
          * 
          * @return: Shaded pixel colour
         */
-        virtual Vector3f shade(const Vector3f &colour, const Vector3f &pos, const std::vector<Light> &lights, const Vector3f &view_pos, const Vector3f &normal) = 0;
+        Vector3f shade(const Vector3f &colour, const Vector3f &pos, const std::vector<Light> &lights, const Vector3f &view_pos, const Vector3f &normal) {
+            return this->shade(colour, pos, lights.data(), lights.size(), lights.size(), view_pos, normal);
+        }
+
+        /**
+         * Shades a given pixel colour using a subset of the lights in the scene (e.g. the lights 
+         * of a LightGrid tile). Lights that are left out must not reach pos.
+         * 
+         * @param colour: Colour of the pixel being shaded
+         * @param pos: Hit/colour posiiton
+         * @param lights: Lights that can reach pos
+         * @param num_lights: Number of lights that can reach pos
+         * @param num_scene_lights: Number of lights in the scene. The output is normalised by it
+         * @param view_pos: View/eye position
+         * @param normal: Normal vector at the hit position
+         * 
+         * @return: Shaded pixel colour
+        */
+        virtual Vector3f shade(const Vector3f &colour, const Vector3f &pos, const Light *lights, const int num_lights, const int num_scene_lights, 
+                               const Vector3f &view_pos, const Vector3f &normal) = 0;
 
         virtual ~Shader() {}
 };
@@ -38,10 +60,13 @@ class BlinnPhongShader : public Shader {
     public:
         BlinnPhongShader() = default;
 
+        using Shader::shade;
+
         /**
          * See Shader::shade documentation
         */
-        Vector3f shade(const Vector3f &colour, const Vector3f &pos, const std::vector<Light> &lights, const Vector3f &view_pos, const Vector3f &normal);
+        Vector3f shade(const Vector3f &colour, const Vector3f &pos, const Light *lights, const int num_lights, const int num_scene_lights, 
+                       const Vector3f &view_pos, const Vector3f &normal);
 };
 
 /**
@@ -51,10 +76,13 @@ class LambertianShader : public Shader {
     public:
         LambertianShader() = default;
 
+        using Shader::shade;
+
         /**
          * See Shader::shade documentation
         */
-        Vector3f shade(const Vector3f &colour, const Vector3f &pos, const std::vector<Light> &lights, const Vector3f &view_pos, const Vector3f &normal);
+        Vector3f shade(const Vector3f &colour, const Vector3f &pos, const Light *lights, const int num_lights, const int num_scene_lights, 
+                       const Vector3f &view_pos, const Vector3f &normal);
 };
 
 /**
@@ -70,10 +98,13 @@ class OrenNayarShader : public Shader {
     public:
         OrenNayarShader() = default;
 
+        using Shader::shade;
+
         /**
          * See Shader::shade documentation
         */
-        Vector3f shade(const Vector3f &colour, const Vector3f &pos, const std::vector<Light> &lights, const Vector3f &view_pos, const Vector3f &normal);
+        Vector3f shade(const Vector3f &colour, const Vector3f &pos, const Light *lights, const int num_lights, const int num_scene_lights, 
+                       const Vector3f &view_pos, const Vector3f &normal);
 };
 
 
@@ -84,10 +115,13 @@ class ToonShader : public Shader {
     public:
         ToonShader() = default;
 
+        using Shader::shade;
+
         /**
          * See Shader::shade documentation
         */
-        Vector3f shade(const Vector3f &colour, const Vector3f &pos, const std::vector<Light> &lights, const Vector3f &view_pos, const Vector3f &normal);
+        Vector3f shade(const Vector3f &colour, const Vector3f &pos, const Light *lights, const int num_lights, const int num_scene_lights, 
+                       const Vector3f &view_pos, const Vector3f &normal);
 };
 
 /**
@@ -97,8 +131,66 @@ class NormalShader : public Shader {
     public:
         NormalShader() = default;
 
+        using Shader::shade;
+
         /**
          * See Shader::shade documentation
         */
-        Vector3f shade(const Vector3f &colour, const Vector3f &pos, const std::vector<Light> &lights, const Vector3f &view_pos, const Vector3f &normal);
-};
\ No newline at end of file
+        Vector3f shade(const Vector3f &colour, const Vector3f &pos, const Light *lights, const int num_lights, const int num_scene_lights, 
+                       const Vector3f &view_pos, const Vector3f &normal);
+};
+
+/**
+ * Shading lookup table indexed by the normal, for distant lights and an orthographic view.
+ * 
+ * Every shader is affine in the colour being shaded: shade(c) = c * D + S, where D and S only 
+ * depend on the normal once the light and view directions are fixed. Evaluating the lights and 
+ * view from a single reference position (e.g. the centre of the image) fixes those directions, 
+ * so D and S are tabulated over the normals of the upper hemisphere and shading a pixel becomes 
+ * one table fetch and a multiply-add.
+*/
+class ShadingTable {
+    private:
+        // The table has size x size entries over the normal x and y components in [-1, 1]
+        static const int size = 256;
+
+        // Per-entry colour factor (D) and offset (S)
+        std::vector<Vector3f> factors;
+        std::vector<Vector3f> offsets;
+
+    public:
+        /**
+         * Constructor for ShadingTable.
+         * 
+         * @param shader: Shader to tabulate
+         * @param lights: Lights in the scene
+         * @param view_pos: View/eye position
+         * @param pos: Reference position the light and view directions are computed from
+        */
+        ShadingTable(Shader *shader, const std::vector<Light> &lights, const Vector3f &view_pos, const Vector3f &pos);
+
+        /**
+         * Shades a pixel colour using the nearest table entry.
+         * 
+         * @param colour: Colour of the pixel being shaded
+         * @param normal: Normal vector at the pixel (z >= 0)
+         * 
+         * @return: Shaded pixel colour
+        */
+        Vector3f shade(const Vector3f &colour, const Vector3f &normal) const {
+            int ix = std::min(std::max((int) ((normal.x() + 1.0f) * 0.5f * (size - 1) + 0.5f), 0), size - 1);
+            int iy = std::min(std::max((int) ((normal.y() + 1.0f) * 0.5f * (size - 1) + 0.5f), 0), size - 1);
+            int i = iy * size + ix;
+            return colour.cwiseProduct(this->factors[i]) + this->offsets[i];
+        }
+
+        /**
+         * Shades a run of pixels with the selected SIMD kernels. Matches shade() for every pixel.
+         * 
+         * @param colours: Colours of the pixels (packed RGB)
+         * @param normals: Normal vectors at the pixels (packed xyz, z >= 0)
+         * @param n: Number of pixels
+         * @param shaded: Output for the shaded colours (packed RGB)
+        */
+        void shade(const float *colours, const float *normals, const int n, float *shaded) const;
+};
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+/**
+ * Hot image kernels compiled once per instruction set and picked at run-time.
+ *
+ * The kernels work on raw single precision buffers (no Eigen) so that the compiler can
+ * vectorise them for the instruction set of each variant. Every variant is built from the same
+ * source (src/simd_kernels.inc) without fused multiply-adds, so all variants round identically
+ * and produce bit-identical results. The best variant the CPU supports is selected on first use.
+ *
+ * RGB pixels and normals are packed as three consecutive floats.
+*/
+namespace Simd {
+    // Number of strokes trace_strokes advances in lockstep
+    const int trace_lanes = 16;
+
+    /**
+     * Function table of a single instruction set variant
+    */
+    struct KernelTable {
+        // Name of the variant (e.g. "avx2")
+        const char *name;
+
+        /**
+         * acc[i] += value * src[i] for i in [0, n)
+        */
+        void (*axpy)(float *acc, const float *src, const float value, const int n);
+
+        /**
+         * Distance to the compare pixels and luminosity of n RGB pixels.
+         *
+         * @param differences: Output for the distances (can be nullptr, then compare is not read)
+         * @param luminosity: Output for the luminosity (can be nullptr)
+        */
+        void (*difference_luminosity)(const float *pixels, const float *compare, float *differences, float *luminosity, const int n);
+
+        /**
+         * Unit normals (-gx, -gy, 1) of a column of a gray-scale image from its normalised 3x3
+         * gradient. The image is column-major (pixel (x, y) at gray[x * height + y]).
+         *
+         * @param sobel_x: Horizontal 3x3 kernel, value (i, j) at sobel_x[i * 3 + j]
+         * @param sobel_y: Vertical 3x3 kernel, value (i, j) at sobel_y[i * 3 + j]
+         * @param normals: Output for the normals of rows [y_begin, y_end)
+        */
+        void (*sobel_normals)(const float *gray, const int width, const int height, const float *sobel_x, const float *sobel_y,
+                              const int x, const int y_begin, const int y_end, float *normals);
+
+        /**
+         * colour * factor + offset of n pixels, with the factor and offset of the size x size
+         * table entry closest to the normal x and y components of each pixel.
+        */
+        void (*shade_table)(const float *colours, const float *normals, const int n, const float *factors, const float *offsets,
+                            const int size, float *shaded);
+
+        /**
+         * Blends n pixels with a stroke.
+         *
+         * @param colour: Stroke colour (RGB)
+         * @param height_offset: Added to every composed height
+         * @param alphas: Brush mask value of each pixel
+         * @param opacities: Stroke opacity of each pixel (0 - 255)
+         * @param stroke_heights: Stroke height of each pixel
+         * @param colours: Colour under the stroke. Overwritten with the blended colour
+         * @param heights: Height under the stroke. Overwritten with the composed height
+        */
+        void (*composite)(const float *colour, const float height_offset, const float *alphas, const float *opacities,
+                          const float *stroke_heights, float *colours, float *heights, const int n);
+
+        /**
+         * Traces n strokes like the tracing constructor of Stroke, trace_lanes strokes at a time in
+         * lockstep. Strokes that have stopped are masked out until every stroke of the batch has stopped.
+         *
+         * @param reference: Reference (blurred) image, column-major RGB
+         * @param canvas: Canvas, column-major RGB
+         * @param gradients: Gradients (gx, gy, magnitude) of the reference image, column-major
+         * @param length: Distance between control points
+         * @param seeds_x: x-coordinate of the first control point of each stroke
+         * @param seeds_y: y-coordinate of the first control point of each stroke
+         * @param points_x: Output for the control points. Point i of stroke s is at points_x[i * n + s]
+         * @param points_y: Output for the control points, like points_x
+         * @param num_points: Output for the number of control points of each stroke
+        */
+        void (*trace_strokes)(const float *reference, const float *canvas, const float *gradients, const int width, const int height,
+                              const int length, const int *seeds_x, const int *seeds_y, const int n, float *points_x, float *points_y,
+                              int *num_points);
+    };
+
+    // Variant tables, or nullptr if the variant is not compiled in (e.g. on other architectures)
+    const KernelTable *get_baseline_kernels();
+    const KernelTable *get_sse42_kernels();
+    const KernelTable *get_avx2_kernels();
+    const KernelTable *get_avx512_kernels();
+
+    /**
+     * @return: Variants that are compiled in and supported by the CPU, from the most basic to the best
+    */
+    std::vector<const KernelTable *> get_available();
+
+    /**
+     * Selects the kernels used by the image operations. Must not be called while they are running.
+     *
+     * @param name: Name of a variant, or "auto" for the best available variant
+     *
+     * @throws std::invalid_argument: If the variant does not exist or the CPU does not support it
+    */
+    void select(const std::string &name);
+
+    /**
+     * @return: Kernels used by the image operations
+    */
+    const KernelTable &get();
+
+    /**
+     * Runs every available variant on the same synthetic data, checks that the results match the
+     * baseline variant bit-for-bit and prints the time of each kernel.
+     *
+     * @return: True if every variant matches the baseline
+    */
+    bool benchmark();
+}
@@ -1,54 +1,72 @@
 #pragma once
 
+#include <array>
+#include <cstdint>
+#include <vector>
+
 #include <Eigen/Eigen>
 
 #include "texture.hpp"
+#include "parameters.hpp"
 
 using namespace Eigen;
 
+/**
+ * Order in which the strokes of a layer are rendered. Later strokes are composited over earlier 
+ * ones, so the order changes the painting.
+*/
+enum class StrokeOrder {
+    // Grid rows from top to bottom (the order the strokes are placed in)
+    RASTER,
+    // Shuffled with a fixed seed per layer, so paintings are reproducible
+    RANDOM,
+    // Along a Z-order (Morton) curve through the centres of the stroke bounding boxes
+    MORTON,
+    // Along a Hilbert curve through the centres of the stroke bounding boxes
+    HILBERT
+};
+
 class Stroke {
     private:
         int radius;
         Vector3f colour;
         std::vector<Vector2f> control_points;
-        std::vector<Vector2f> limit;
+
+        // Number of limit curve steps for each segment between two control points
+        std::array<int, ProgramParameters::max_stroke_length> segment_steps;
+        // Number of points in the limit curve
+        int limit_size = 0;
 
         // Height and opacity textures of the stroke
-        Texture *height_texture = nullptr;
-        Texture *opacity_texture = nullptr;
+        const TextureSampler *sampler = nullptr;
 
         // Bottom-left and top-right coordinates for bounding box
         Vector2i bottom_left;
         Vector2i top_right;
 
-        // Angle threshold - used to ensure smooth interpolation
-        const double theta_tol = 0.1;
-        // Distance threshold - used to ensure smooth interpolation
-        const int neighbourhood = 2;
-        const bool clean = false;
+        // Mip level of the textures matching the stroke footprint
+        int mip_level = 0;
+        // Texel coordinates of the bottom-left corner (TextureSampler::frac_bits fractional bits)
+        int texel_origin_x = 0, texel_origin_y = 0;
+        // Texels per canvas pixel (16 fractional bits)
+        int64_t texel_step_x = 0, texel_step_y = 0;
 
-        /**
-         * Determines if the limit has been completed.
-         * Removes redundant points from the limit if needed.
-        */
-        bool limit_is_done();
+        // Maximum distance (in pixels) between the limit curve and its linear interpolation
+        static constexpr float flatness_tol = 0.5f;
 
         /**
-         * Performs cubic b-spline interpolation on the control points
-         * The interpolated points are stored in the limit vector
+         * @param i: Index of the control point. Can be one past either end of the stroke
+         * 
+         * @return: The control point. Points past the ends are reflected so that the curve 
+         *          interpolates the first and last control points
         */
-        void compute_limit_curve();
+        Vector2f get_control_point(const int i) const;
 
         /**
-         * Computes the UV coordinates cooresponding to a (x, y) point in the 
-         * image
-         * 
-         * @param x: x-coordinate in the image
-         * @param y: y-coordinate in the image
-         * 
-         * @return: UV coordinates 
+         * Computes the number of limit curve steps needed for each segment of the cubic 
+         * b-spline so that every segment is flat to within flatness_tol.
         */
-        Vector2f get_uv_coords(const int x, const int y) const;
+        void compute_segment_steps();
 
         /**
          * Computes the bounding box of the stroke
@@ -58,6 +76,12 @@ class Stroke {
         */
         void compute_bounding_box(int width, int height);
 
+        /**
+         * Selects the texture mip level and the fixed-point mapping from canvas pixels to 
+         * texels. The textures are stretched over the bounding box of the stroke.
+        */
+        void compute_texture_mapping();
+
     public:
         Stroke() {}
 
@@ -73,11 +97,56 @@ class Stroke {
          * @param radius: radius of the stroke
          * @param ref_image: reference image 
          * @param canvas: canvas image - where the stroke will be drawn
-         * @param luminosity: luminosity of the reference image. Used to compute image gradients
-         * @param height_texture: height texture of the stroke
-         * @param opacity_texture: opacity texture of the stroke
+         * @param gradients: gradients of the luminosity of the reference image (see GrayImage::compute_gradients)
+         * @param sampler: height and opacity textures of the stroke
         */
-        Stroke(int x, int y, int radius, RGBImage *ref_image, RGBImage *canvas, GrayImage *luminosity, Texture *height_texture, Texture *opacity_texture);
+        Stroke(int x, int y, int radius, RGBImage *ref_image, RGBImage *canvas, const VectorMatrix *gradients, const TextureSampler *sampler);
+
+        /**
+         * Constructor for Stroke.
+         * 
+         * Creates a stroke from previously traced control points (e.g. from a StrokeList).
+         * 
+         * @param control_points: Control points of the stroke (at least one and at most ProgramParameters::max_stroke_length)
+         * @param num_points: Number of control points
+         * @param radius: radius of the stroke
+         * @param colour: colour of the stroke
+         * @param width: width of the canvas
+         * @param height: height of the canvas
+         * @param sampler: height and opacity textures of the stroke
+        */
+        Stroke(const Vector2f *control_points, int num_points, int radius, Vector3f colour, int width, int height, const TextureSampler *sampler);
+
+        /**
+         * Traces the strokes of many seeds at once with the batched tracer of the selected image 
+         * kernels (see Simd::KernelTable::trace_strokes). Produces the same strokes as tracing 
+         * each seed with the tracing constructor, which is used for integer pixel storage.
+         * 
+         * @param seeds: First control point of each stroke
+         * @param n: Number of strokes
+         * @param radius: radius of the strokes
+         * @param ref_image: reference image 
+         * @param canvas: canvas image - where the strokes will be drawn
+         * @param gradients: gradients of the luminosity of the reference image (see GrayImage::compute_gradients)
+         * @param sampler: height and opacity textures of the strokes
+         * @param strokes: Output for the n strokes
+        */
+        static void trace(const Vector2i *seeds, int n, int radius, RGBImage *ref_image, RGBImage *canvas, const VectorMatrix *gradients, 
+                          const TextureSampler *sampler, Stroke *strokes);
+
+        /**
+         * @return: Returns the radius of the stroke
+        */
+        int get_radius() const {
+            return this->radius;
+        }
+
+        /**
+         * @return: Returns the control points of the stroke
+        */
+        const std::vector<Vector2f> &get_control_points() const {
+            return this->control_points;
+        }
 
         /**
          * @return: Returns the colour of the stroke
@@ -90,25 +159,135 @@ class Stroke {
          * @param x: x-coordinate in the image
          * @param y: y-coordinate in the image
          * 
-         * @return: The stroke height at (x, y)
+         * @return: The stroke height and opacity at (x, y)
         */
-        float get_height(const int x, const int y) const;
+        TextureSample get_texture_sample(const int x, const int y) const;
 
         /**
-         * @param x: x-coordinate in the image
-         * @param y: y-coordinate in the image
+         * @return: Bottom-left corner of the stroke bounding box
+        */
+        Vector2i get_bottom_left() const {
+            return this->bottom_left;
+        }
+
+        /**
+         * @return: Top-right corner of the stroke bounding box
+        */
+        Vector2i get_top_right() const {
+            return this->top_right;
+        }
+
+        /**
+         * @return: The number of points in the limit curve of the stroke
+        */
+        int get_limit_size() const {
+            return this->limit_size;
+        }
+
+        /**
+         * Evaluates the cubic b-spline through the control points.
          * 
-         * @return: The stroke opacity at (x, y)
+         * @param limit: Output buffer. Must hold at least get_limit_size() points
         */
-        float get_opacity(const int x, const int y) const;
+        void compute_limit(Vector2f *limit) const;
+};
 
+/**
+ * Orders strokes for rendering. The space-filling curves keep consecutive strokes close together, 
+ * so rendering revisits the canvas and height map rows that are already in cache.
+*/
+namespace StrokeOrdering {
+    /**
+     * @param x: x-coordinate (less than 2^16)
+     * @param y: y-coordinate (less than 2^16)
+     * 
+     * @return: Position of (x, y) along the Z-order curve (the bits of x and y interleaved)
+    */
+    uint32_t morton_key(uint32_t x, uint32_t y);
+
+    /**
+     * @param x: x-coordinate (less than size)
+     * @param y: y-coordinate (less than size)
+     * @param size: Side of the square covered by the curve (a power of two)
+     * 
+     * @return: Position of (x, y) along the Hilbert curve
+    */
+    uint32_t hilbert_key(uint32_t x, uint32_t y, uint32_t size);
+
+    /**
+     * @param strokes: Traced strokes
+     * @param order: Order to render the strokes in
+     * @param width: Width of the canvas
+     * @param height: Height of the canvas
+     * @param seed: Seed of the random order
+     * 
+     * @return: Indices of the strokes in rendering order. Strokes at the same curve position 
+     *          keep their raster order
+    */
+    std::vector<int> get_order(const std::vector<Stroke> &strokes, StrokeOrder order, int width, int height, uint32_t seed);
+}
+
+/**
+ * Compositing scratch of the stroke being rendered.
+ * 
+ * Overlapping brush stamps visit the same pixel many times. The first visit of a pixel samples 
+ * the stroke textures and remembers the canvas colour under the stroke. Later visits only index 
+ * into the tile. The tile covers the pixels the stroke can reach and is reused (and only grows) 
+ * across strokes. Records are invalidated by bumping an epoch rather than clearing the tile.
+*/
+class StrokeFootprint {
+    public:
         /**
-         * @return: The limit of the Stroke. Computes the limit if needed
+         * Compositing state of a single pixel.
+        */
+        struct Record {
+            // Epoch of the stroke that last visited the pixel
+            uint32_t epoch;
+            // Largest brush mask value the stroke has covered the pixel with
+            float mask;
+            // Canvas colour before the stroke was rendered
+            ColourStorage old_colour;
+            // Stroke height and opacity at the pixel
+            TextureSample sample;
+        };
+
+    private:
+        // Epoch of the stroke being rendered. Records from other strokes are stale
+        uint32_t epoch = 0;
+
+        // Bottom-left corner and dimensions of the tile
+        int x0 = 0, y0 = 0;
+        int width = 0, height = 0;
+
+        // Row-major records of the tile
+        std::vector<Record> records;
+
+    public:
+        StrokeFootprint() {}
+
+        /**
+         * Starts rendering a new stroke. Sizes the tile to the pixels the brush mask can reach 
+         * while following the limit curve.
+         * 
+         * @param limit: Limit curve of the stroke
+         * @param limit_size: Number of points in the limit curve
+         * @param mask: Brush mask the stroke is rendered with
+         * @param canvas_width: width of the canvas
+         * @param canvas_height: height of the canvas
+        */
+        void begin(const Vector2f *limit, const int limit_size, const Kernel *mask, const int canvas_width, const int canvas_height);
+
+        uint32_t get_epoch() const {
+            return this->epoch;
+        }
+
+        /**
+         * @param x: x-coordinate in the image. Must be reachable by the current stroke
+         * @param y: y-coordinate in the image. Must be reachable by the current stroke
+         * 
+         * @return: The compositing record of (x, y). Stale unless its epoch matches get_epoch()
         */
-        std::vector<Vector2f> get_limit() {
-            if (this->limit.size() == 0) {
-                compute_limit_curve();
-            }
-            return this->limit;
+        Record &get_record(const int x, const int y) {
+            return this->records[(y - this->y0) * this->width + (x - this->x0)];
         }
 };
\ No newline at end of file
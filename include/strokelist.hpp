@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <Eigen/Eigen>
+
+#include "stroke.hpp"
+
+using namespace Eigen;
+
+/**
+ * Compact list of the strokes of a painting.
+ *
+ * A stroke list stores everything needed to re-render a painting (stroke radius, colour, layer
+ * and control points) without tracing the strokes again, so the same painting can be rendered
+ * at any resolution and with any brush stroke textures.
+ *
+ * File layout (native byte order, every section 4-byte aligned so the file can be memory-mapped):
+ *      Header
+ *      Record[num_strokes]      (in rendering order)
+ *      float[2 * num_points]    (control points of every stroke, in canvas pixels)
+*/
+class StrokeList {
+    public:
+        struct Header {
+            char magic[4];
+            uint32_t version;
+            // Dimensions of the painted canvas
+            int32_t width, height;
+            // Colour the canvas was cleared to
+            float background[3];
+            uint32_t num_strokes;
+            uint32_t num_points;
+        };
+
+        struct Record {
+            float colour[3];
+            float radius;
+            // Index of the first control point of the stroke
+            uint32_t first_point;
+            uint16_t num_points;
+            // Index of the layer the stroke was painted in
+            uint16_t layer;
+        };
+
+    private:
+        int width, height;
+        Vector3f background;
+
+        std::vector<Record> records;
+        std::vector<Vector2f> points;
+
+    public:
+        /**
+         * Constructor for StrokeList. Creates an empty list.
+         *
+         * @param width: width of the painted canvas
+         * @param height: height of the painted canvas
+         * @param background: colour the canvas was cleared to
+        */
+        StrokeList(int width, int height, Vector3f background);
+
+        int get_width() const {
+            return this->width;
+        }
+
+        int get_height() const {
+            return this->height;
+        }
+
+        Vector3f get_background() const {
+            return this->background;
+        }
+
+        int get_num_strokes() const {
+            return this->records.size();
+        }
+
+        const Record &get_record(const int i) const {
+            return this->records[i];
+        }
+
+        /**
+         * @param i: Index of the stroke
+         *
+         * @return: The control points of the stroke (get_record(i).num_points of them)
+        */
+        const Vector2f *get_points(const int i) const {
+            return this->points.data() + this->records[i].first_point;
+        }
+
+        /**
+         * Appends a stroke to the list.
+         *
+         * @param stroke: Stroke to append
+         * @param layer: Index of the layer the stroke was painted in
+        */
+        void add(const Stroke *stroke, const int layer);
+
+        /**
+         * Writes the stroke list to disk.
+         *
+         * @param path: Path of the stroke list file
+         *
+         * @return: True if the stroke list was written successfully
+        */
+        bool save(const std::string &path) const;
+
+        /**
+         * Reads a stroke list from disk.
+         *
+         * @param path: Path of the stroke list file
+         *
+         * @return: The stroke list, or nullptr if the file does not exist or is invalid (including a file
+         *          whose size does not match the counts in its header). Must be freed
+        */
+        static StrokeList *load(const std::string &path);
+};
@@ -1,5 +1,10 @@
 #pragma once
 
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
 #include "image.hpp"
 
 /** 
@@ -36,5 +41,175 @@ class Texture {
             return this->texture->get_height();
         }
 
+        const GrayImage *get_image() const {
+            return this->texture;
+        }
+
         float get_texture_value(const Vector2f uv_coords) const;
-};   
\ No newline at end of file
+};   
+
+/**
+ * Height and opacity of a brush stroke texture at a single point.
+*/
+struct TextureSample {
+    float height;
+    float opacity;
+};
+
+/**
+ * Prefiltered, fixed-point sampler for the height and opacity brush stroke textures.
+ * 
+ * Both textures are stored interleaved (one 8-bit height and one 8-bit opacity per texel) in 
+ * 8x8 texel tiles, so a bilinear lookup of both channels touches at most four nearby texels. 
+ * Box-filtered mip levels are built once so that strokes much smaller than the texture can 
+ * sample a level that matches their footprint.
+*/
+class TextureSampler {
+    public:
+        // Number of fractional bits used by texel coordinates
+        static const int frac_bits = 8;
+
+    private:
+        // Tiles are tile_size x tile_size texels
+        static const int tile_bits = 3;
+        static const int tile_size = 1 << tile_bits;
+
+        struct MipLevel {
+            int width, height;
+            // Number of tiles in each row of tiles
+            int tiles_x;
+            // Tiled texels. The low byte is the height and the high byte is the opacity
+            std::vector<uint16_t> texels;
+        };
+
+        std::vector<MipLevel> levels;
+
+        /**
+         * @param level: Mip level
+         * @param x: x-coordinate of the texel
+         * @param y: y-coordinate of the texel
+         * 
+         * @return: Index of the texel (x, y) in the tiled texel buffer
+        */
+        static int tiled_index(const MipLevel &level, const int x, const int y) {
+            return (((y >> tile_bits) * level.tiles_x + (x >> tile_bits)) << (2 * tile_bits)) + 
+                ((y & (tile_size - 1)) << tile_bits) + (x & (tile_size - 1));
+        }
+
+        /**
+         * @param level: Mip level
+         * @param x: x-coordinate of the texel
+         * @param y: y-coordinate of the texel
+         * 
+         * @return: Texel at (x, y) with its height in the lower 32 bits and opacity in the upper 32 bits
+        */
+        static uint64_t get_texel(const MipLevel &level, const int x, const int y) {
+            uint16_t texel = level.texels[tiled_index(level, x, y)];
+            return (texel & 0xff) | (static_cast<uint64_t>(texel >> 8) << 32);
+        }
+
+        /**
+         * Creates an empty mip level of the given size.
+        */
+        static MipLevel make_level(const int width, const int height);
+
+    public:
+        /**
+         * Constructor for TextureSampler.
+         * 
+         * Missing textures are replaced by a constant height of 1 and a constant opacity of 125.
+         * If the textures have different dimensions, the opacity texture is resampled to the 
+         * dimensions of the height texture.
+         * 
+         * @param height_texture: Height texture of the brush strokes (can be nullptr)
+         * @param opacity_texture: Opacity texture of the brush strokes (can be nullptr)
+        */
+        TextureSampler(const Texture *height_texture, const Texture *opacity_texture);
+
+        int get_num_levels() const {
+            return this->levels.size();
+        }
+
+        int get_width(const int level) const {
+            return this->levels[level].width;
+        }
+
+        int get_height(const int level) const {
+            return this->levels[level].height;
+        }
+
+        /**
+         * Selects the mip level whose resolution best matches a footprint on the canvas.
+         * 
+         * @param footprint_width: width (in pixels) the texture is stretched over
+         * @param footprint_height: height (in pixels) the texture is stretched over
+         * 
+         * @return: Mip level to sample
+        */
+        int select_level(const int footprint_width, const int footprint_height) const;
+
+        /**
+         * Bilinearly samples both textures. Coordinates are clamped to the mip level.
+         * 
+         * @param level: Mip level to sample
+         * @param tx: x-coordinate in texels with frac_bits fractional bits
+         * @param ty: y-coordinate in texels with frac_bits fractional bits
+         * 
+         * @return: Height and opacity at (tx, ty)
+        */
+        TextureSample sample(const int level, const int tx, const int ty) const;
+};
+
+/**
+ * Height and opacity textures of the brush strokes, loaded and prefiltered once.
+ * 
+ * Read-only after construction, so a single instance can be shared (e.g. through a 
+ * std::shared_ptr<const BrushTextures>) by any number of concurrent paintings.
+*/
+class BrushTextures {
+    private:
+        Texture *height_texture;
+        Texture *opacity_texture;
+        TextureSampler *sampler;
+
+    public:
+        /**
+         * Constructor for BrushTextures. Takes ownership of the textures.
+         * 
+         * @param height_texture: Height texture of the brush strokes (can be nullptr)
+         * @param opacity_texture: Opacity texture of the brush strokes (can be nullptr)
+        */
+        BrushTextures(Texture *height_texture, Texture *opacity_texture);
+
+        BrushTextures(const BrushTextures &) = delete;
+        BrushTextures &operator=(const BrushTextures &) = delete;
+
+        ~BrushTextures() {
+            delete this->height_texture;
+            delete this->opacity_texture;
+            delete this->sampler;
+        }
+
+        /**
+         * Loads height.png and opacity.png from a directory.
+         * 
+         * @param directory: Directory of the textures (including the trailing separator)
+         * 
+         * @return: The brush textures
+         * 
+         * @throws std::invalid_argument: If either texture cannot be read
+        */
+        static std::shared_ptr<const BrushTextures> load(const std::string &directory);
+
+        const Texture *get_height_texture() const {
+            return this->height_texture;
+        }
+
+        const Texture *get_opacity_texture() const {
+            return this->opacity_texture;
+        }
+
+        const TextureSampler *get_sampler() const {
+            return this->sampler;
+        }
+};
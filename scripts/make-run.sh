@@ -4,4 +4,4 @@ cmake ..
 make
 
 # Run on input image and shader
-./fast-paint-texture $1 $2
\ No newline at end of file
+./fast-paint-texture "$@"
\ No newline at end of file
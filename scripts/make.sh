@@ -1,4 +1,5 @@
 ANIMATE=""
+PRECISION="FLOAT"
 
 # Parse command line arguments
 while [[ $# -gt 0 ]] 
@@ -10,6 +11,10 @@ do
             ANIMATE="ON"
             shift
             ;;
+        -PRECISION=*)
+            PRECISION="${key#*=}"
+            shift
+            ;;
         *)
             # Unknown option
             echo "Unknown option: $key"
@@ -22,11 +27,11 @@ done
 cd build
 
 if [ -n "$ANIMATE" ]; then
-    echo "cmake -DANIMATE=$ANIMATE .."
-    cmake -DANIMATE="$ANIMATE" ..
+    echo "cmake -DANIMATE=$ANIMATE -DPRECISION=$PRECISION .."
+    cmake -DANIMATE="$ANIMATE" -DPRECISION="$PRECISION" ..
 else
-    echo "cmake .."
-    cmake ..
+    echo "cmake -DPRECISION=$PRECISION .."
+    cmake -DPRECISION="$PRECISION" ..
 fi
 
 make
\ No newline at end of file
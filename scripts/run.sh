@@ -1,4 +1,4 @@
 cd build
 
 # Run on input image and shader
-./fast-paint-texture $1 $2
\ No newline at end of file
+./fast-paint-texture "$@"
\ No newline at end of file
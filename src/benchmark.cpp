@@ -0,0 +1,192 @@
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#ifdef __linux__
+    #include <linux/perf_event.h>
+    #include <sys/ioctl.h>
+    #include <sys/syscall.h>
+    #include <unistd.h>
+#endif
+
+#include "benchmark.hpp"
+#include "paint.hpp"
+#include "stroke.hpp"
+#include "strokelist.hpp"
+
+namespace {
+    /**
+     * @param cache: perf_hw_cache_id of the cache
+     *
+     * @return: File descriptor of a disabled read miss counter, or -1 if it cannot be opened
+    */
+    int open_counter(uint64_t cache) {
+        #ifdef __linux__
+            perf_event_attr attr = {};
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config = cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        #else
+            (void) cache;
+            return -1;
+        #endif
+    }
+
+    /**
+     * @param counter: File descriptor of the counter
+     *
+     * @return: Value of the counter
+    */
+    uint64_t read_counter(int counter) {
+        uint64_t value = 0;
+        #ifdef __linux__
+            if (read(counter, &value, sizeof(value)) != sizeof(value)) {
+                value = 0;
+            }
+        #else
+            (void) counter;
+        #endif
+        return value;
+    }
+}
+
+namespace Benchmark {
+    CacheMissCounter::CacheMissCounter() {
+        #ifdef __linux__
+            this->l1_counter = open_counter(PERF_COUNT_HW_CACHE_L1D);
+            this->ll_counter = open_counter(PERF_COUNT_HW_CACHE_LL);
+            if (this->l1_counter < 0 || this->ll_counter < 0) {
+                if (this->l1_counter >= 0) {
+                    close(this->l1_counter);
+                }
+                if (this->ll_counter >= 0) {
+                    close(this->ll_counter);
+                }
+                this->l1_counter = this->ll_counter = -1;
+            }
+        #endif
+    }
+
+    CacheMissCounter::~CacheMissCounter() {
+        #ifdef __linux__
+            if (this->is_available()) {
+                close(this->l1_counter);
+                close(this->ll_counter);
+            }
+        #endif
+    }
+
+    void CacheMissCounter::start() {
+        #ifdef __linux__
+            if (this->is_available()) {
+                for (int counter : {this->l1_counter, this->ll_counter}) {
+                    ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+                    ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+                }
+            }
+        #endif
+    }
+
+    std::pair<uint64_t, uint64_t> CacheMissCounter::stop() {
+        #ifdef __linux__
+            if (this->is_available()) {
+                ioctl(this->l1_counter, PERF_EVENT_IOC_DISABLE, 0);
+                ioctl(this->ll_counter, PERF_EVENT_IOC_DISABLE, 0);
+                return {read_counter(this->l1_counter), read_counter(this->ll_counter)};
+            }
+        #endif
+        return {0, 0};
+    }
+
+    void stroke_orders(const cv::Mat &input_image, const std::shared_ptr<const BrushTextures> &brushes) {
+        const int num_runs = 5;
+        const std::vector<std::pair<std::string, StrokeOrder>> orders = {
+            {"raster", StrokeOrder::RASTER},
+            {"random", StrokeOrder::RANDOM},
+            {"morton", StrokeOrder::MORTON},
+            {"hilbert", StrokeOrder::HILBERT}
+        };
+
+        int width = input_image.cols, height = input_image.rows;
+
+        // Record the strokes of the painting (in raster order)
+        StrokeList painted_strokes(width, height, Vector3f::Zero());
+        FastPaintTexture paint(width, height, input_image, brushes);
+        paint.set_stroke_list(&painted_strokes);
+
+        RGBImage *paint_image;
+        GrayImage *height_map;
+        std::tie(std::ignore, paint_image, height_map) = paint.fast_paint_texture(nullptr);
+        delete paint_image;
+        delete height_map;
+
+        CacheMissCounter counter;
+        if (!counter.is_available()) {
+            std::cout << "Cache miss counters are unavailable: only timing the rendering" << std::endl;
+        }
+
+        std::vector<std::string> results;
+        double raster_ms = 0.0;
+
+        for (const std::pair<std::string, StrokeOrder> &order : orders) {
+            StrokeList stroke_list(width, height, painted_strokes.get_background());
+
+            // Reorder the strokes within each layer (layers are still rendered from largest to smallest brush)
+            for (int first = 0; first < painted_strokes.get_num_strokes();) {
+                int layer = painted_strokes.get_record(first).layer;
+                std::vector<Stroke> strokes;
+                for (; first < painted_strokes.get_num_strokes() && painted_strokes.get_record(first).layer == layer; first++) {
+                    const StrokeList::Record &record = painted_strokes.get_record(first);
+                    strokes.push_back(Stroke(painted_strokes.get_points(first), record.num_points, (int) record.radius,
+                        Vector3f(record.colour[0], record.colour[1], record.colour[2]), width, height, brushes->get_sampler()));
+                }
+                for (int i : StrokeOrdering::get_order(strokes, order.second, width, height, layer)) {
+                    stroke_list.add(&strokes[i], layer);
+                }
+            }
+
+            // Fastest of several renders, with the cache misses of that render
+            double best_ms = 0.0;
+            std::pair<uint64_t, uint64_t> best_misses;
+            for (int run = 0; run < num_runs; run++) {
+                counter.start();
+                std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                std::tie(paint_image, height_map) = paint.render(&stroke_list);
+                std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+                std::pair<uint64_t, uint64_t> misses = counter.stop();
+
+                delete paint_image;
+                delete height_map;
+
+                if (run == 0 || elapsed.count() < best_ms) {
+                    best_ms = elapsed.count();
+                    best_misses = misses;
+                }
+            }
+            if (order.second == StrokeOrder::RASTER) {
+                raster_ms = best_ms;
+            }
+
+            std::ostringstream result;
+            result << order.first << ": " << best_ms << " ms (" << stroke_list.get_num_strokes() / best_ms << " strokes per ms, " <<
+                raster_ms / best_ms << "x raster)";
+            if (counter.is_available()) {
+                result << ", L1D misses: " << best_misses.first << ", last-level misses: " << best_misses.second;
+            }
+            results.push_back(result.str());
+        }
+
+        std::cout << "Stroke order benchmark (" << width << "x" << height << ", " << painted_strokes.get_num_strokes() <<
+            " strokes, fastest of " << num_runs << " renders):" << std::endl;
+        for (const std::string &result : results) {
+            std::cout << "  " << result << std::endl;
+        }
+    }
+}
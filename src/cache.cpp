@@ -0,0 +1,338 @@
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <random>
+#include <sstream>
+
+#include "cache.hpp"
+#include "parameters.hpp"
+
+using namespace std;
+
+namespace {
+    // Identifies cached images. Bump the version whenever the layout changes
+    const char image_magic[4] = {'F', 'P', 'T', 'I'};
+    const uint32_t image_version = 1;
+
+    /**
+     * Header of a cached image. Padded to 32 bytes, so the pixels that follow it stay aligned
+    */
+    struct ImageHeader {
+        char magic[4];
+        uint32_t version;
+        int32_t width, height;
+        // Bytes per stored pixel (sizeof(ColourStorage))
+        uint32_t pixel_size;
+        uint32_t padding[3];
+    };
+
+    // Temporary files of entries that are being written
+    const std::string write_extension = ".part";
+
+    // The directory is rescanned after this many commits or this much time since the last scan, 
+    // so that the entries committed by other processes are counted against the size cap
+    const int rescan_commits = 64;
+    const std::chrono::seconds rescan_interval(30);
+
+    /**
+     * @param hasher: Hasher to add the parameters to
+    */
+    void add_parameters(Hasher &hasher) {
+        hasher.add(ProgramParameters::num_layers);
+        hasher.add(ProgramParameters::min_brush_size);
+        hasher.add(ProgramParameters::min_stroke_length);
+        hasher.add(ProgramParameters::max_stroke_length);
+        hasher.add(ProgramParameters::blur_factor);
+        hasher.add(ProgramParameters::filter_fac);
+        hasher.add(ProgramParameters::grid_fac);
+        hasher.add(ProgramParameters::length_fac);
+        hasher.add(ProgramParameters::threshold);
+        hasher.add(ProgramParameters::duplicate_fac);
+        hasher.add(ProgramParameters::edge_importance);
+        hasher.add(ProgramParameters::aa);
+
+        // Pixel storage precision
+        hasher.add(sizeof(ColourStorage));
+        hasher.add(sizeof(GrayStorage));
+    }
+}
+
+void Hasher::add(const void *data, const size_t len) {
+    const unsigned char *bytes = static_cast<const unsigned char *>(data);
+    for (size_t i = 0; i < len; i++) {
+        this->hash ^= bytes[i];
+        this->hash *= 1099511628211ull;
+    }
+}
+
+void Hasher::add(const std::string &str) {
+    this->add(str.size());
+    this->add(str.data(), str.size());
+}
+
+void Hasher::add(const Vector3f &vector) {
+    this->add(vector.x());
+    this->add(vector.y());
+    this->add(vector.z());
+}
+
+void Hasher::add(const cv::Mat &image) {
+    this->add(image.cols);
+    this->add(image.rows);
+    for (int row = 0; row < image.rows; row++) {
+        this->add(image.ptr(row), image.cols * image.elemSize());
+    }
+}
+
+void Hasher::add(const Texture *texture) {
+    if (texture == nullptr) {
+        this->add(-1);
+        return;
+    }
+    this->add(texture->get_image());
+}
+
+void Hasher::add(const RGBImage *image) {
+    this->add(image->get_width());
+    this->add(image->get_height());
+    this->add(sizeof(ColourStorage));
+    this->add(image->get_image()->data(), image->get_image()->size() * sizeof(ColourStorage));
+}
+
+void Hasher::add(const GrayImage *image) {
+    this->add(image->get_width());
+    this->add(image->get_height());
+    for (int y = 0; y < image->get_height(); y++) {
+        for (int x = 0; x < image->get_width(); x++) {
+            this->add(image->get_pixel(x, y));
+        }
+    }
+}
+
+void Hasher::add(const Importance &importance) {
+    this->add(static_cast<int>(importance.source));
+    if (!importance.is_enabled()) {
+        return;
+    }
+    this->add(importance.strength);
+    if (importance.source == ImportanceSource::MASK) {
+        this->add(importance.mask.get());
+    }
+}
+
+std::string Hasher::get_key() const {
+    std::ostringstream key;
+    key << std::hex << std::setw(16) << std::setfill('0') << this->hash;
+    return key.str();
+}
+
+namespace CacheKey {
+    std::string strokes(const cv::Mat &source_image, const StrokeOrder stroke_order, const Importance &importance) {
+        Hasher hasher;
+        hasher.add(std::string("strokes"));
+        hasher.add(source_image);
+        add_parameters(hasher);
+        hasher.add(static_cast<int>(stroke_order));
+        hasher.add(importance);
+        return hasher.get_key();
+    }
+
+    std::string painting(const cv::Mat &source_image, const Texture *height_texture, const Texture *opacity_texture,
+                         const StrokeOrder stroke_order, const Importance &importance) {
+        Hasher hasher;
+        hasher.add(source_image);
+        hasher.add(height_texture);
+        hasher.add(opacity_texture);
+        add_parameters(hasher);
+        hasher.add(static_cast<int>(stroke_order));
+        hasher.add(importance);
+        return hasher.get_key();
+    }
+
+    std::string texture(const std::string &painting_key, const std::string &shader, const Vector3f &view_pos,
+                        const std::vector<Light> &lights, const bool distant_lights) {
+        Hasher hasher;
+        hasher.add(painting_key);
+        hasher.add(shader);
+        hasher.add(view_pos);
+        hasher.add(lights.size());
+        for (const Light &light : lights) {
+            hasher.add(light.get_position());
+            hasher.add(light.get_intensity());
+            hasher.add(light.get_range());
+        }
+        hasher.add(distant_lights);
+        return hasher.get_key();
+    }
+
+    std::string reference(const std::string &source_key, const GaussianKernel *kernel) {
+        Hasher hasher;
+        hasher.add(std::string("reference"));
+        hasher.add(source_key);
+        hasher.add(kernel->get_len());
+        for (int i = 0; i < kernel->get_len(); i++) {
+            for (int j = 0; j < kernel->get_len(); j++) {
+                hasher.add(kernel->get_value(i, j));
+            }
+        }
+        hasher.add(sizeof(ColourStorage));
+        return hasher.get_key();
+    }
+}
+
+Cache::Cache(const std::string &directory, const uintmax_t max_bytes) : next_write(0) {
+    this->directory = directory;
+    this->max_bytes = max_bytes;
+    this->instance_id = std::random_device()();
+
+    std::error_code error;
+    std::filesystem::create_directories(directory, error);
+}
+
+std::string Cache::get_path(const std::string &key) const {
+    return this->directory + key;
+}
+
+bool Cache::lookup(const std::string &key) {
+    std::error_code error;
+    // Refreshing the modification time makes the entry the most recently used one
+    std::filesystem::last_write_time(this->get_path(key), std::filesystem::file_time_type::clock::now(), error);
+    return !error;
+}
+
+std::string Cache::get_write_path(const std::string &key) {
+    // Unique per write and cache instance, so concurrent writers of the same entry do not interfere
+    std::ostringstream path;
+    path << this->get_path(key) << "." << std::hex << this->instance_id << "-" << this->next_write++ << write_extension;
+    return path.str();
+}
+
+bool Cache::commit(const std::string &key, const std::string &write_path, const bool written) {
+    std::error_code error;
+    if (!written) {
+        std::filesystem::remove(write_path, error);
+        return false;
+    }
+
+    // An existing entry of the same key (e.g. written by a concurrent run) is replaced by the rename
+    uintmax_t replaced = std::filesystem::file_size(this->get_path(key), error);
+    if (error) {
+        replaced = 0;
+    }
+    std::filesystem::rename(write_path, this->get_path(key), error);
+    if (error) {
+        std::filesystem::remove(write_path, error);
+        return false;
+    }
+    uintmax_t size = std::filesystem::file_size(this->get_path(key), error);
+    this->evict(key, error ? 0 : size, replaced);
+    return true;
+}
+
+void Cache::evict(const std::string &keep, const uintmax_t size, const uintmax_t replaced) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    this->total_bytes += size;
+    this->total_bytes -= std::min(replaced, this->total_bytes);
+    this->commits_since_scan++;
+
+    bool rescan = !this->scanned || this->commits_since_scan >= rescan_commits || 
+        std::chrono::steady_clock::now() - this->last_scan >= rescan_interval;
+    if (!rescan && this->total_bytes <= this->max_bytes) {
+        return;
+    }
+
+    struct Entry {
+        std::filesystem::path path;
+        std::filesystem::file_time_type last_used;
+        uintmax_t size;
+    };
+    std::vector<Entry> entries;
+    uintmax_t total = 0;
+
+    std::error_code error;
+    for (const std::filesystem::directory_entry &file : std::filesystem::directory_iterator(this->directory, error)) {
+        std::string name = file.path().filename().string();
+        bool writing = name.size() >= write_extension.size() &&
+            name.compare(name.size() - write_extension.size(), write_extension.size(), write_extension) == 0;
+
+        // Entries being written are not counted until they are committed
+        if (!file.is_regular_file(error) || writing) {
+            continue;
+        }
+        Entry entry = {file.path(), file.last_write_time(error), file.file_size(error)};
+        total += entry.size;
+        if (name != keep) {
+            entries.push_back(entry);
+        }
+    }
+    this->scanned = true;
+    this->last_scan = std::chrono::steady_clock::now();
+    this->commits_since_scan = 0;
+    this->total_bytes = total;
+    if (total <= this->max_bytes) {
+        return;
+    }
+
+    // Least recently used first. Evicting below the cap leaves room for the next commits
+    uintmax_t target = this->max_bytes - this->max_bytes / 10;
+    std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) {
+        return a.last_used < b.last_used;
+    });
+    for (const Entry &entry : entries) {
+        if (total <= target) {
+            break;
+        }
+        // Another process may have evicted the entry already
+        if (std::filesystem::remove(entry.path, error)) {
+            total -= entry.size;
+        }
+    }
+    this->total_bytes = total;
+}
+
+bool Cache::save_image(const std::string &key, const RGBImage *image) {
+    std::string write_path = this->get_write_path(key);
+    bool written;
+    {
+        std::ofstream file(write_path, std::ios::binary);
+
+        ImageHeader header = {};
+        std::copy(image_magic, image_magic + 4, header.magic);
+        header.version = image_version;
+        header.width = image->get_width();
+        header.height = image->get_height();
+        header.pixel_size = sizeof(ColourStorage);
+
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char *>(image->get_image()->data()), image->get_image()->size() * sizeof(ColourStorage));
+        written = static_cast<bool>(file);
+    }
+    return this->commit(key, write_path, written);
+}
+
+RGBImage *Cache::load_image(const std::string &key, const int width, const int height) {
+    std::ifstream file(this->get_path(key), std::ios::binary);
+    if (!file) {
+        return nullptr;
+    }
+
+    ImageHeader header;
+    file.read(reinterpret_cast<char *>(&header), sizeof(header));
+    if (!file || !std::equal(header.magic, header.magic + 4, image_magic) || header.version != image_version ||
+        header.width != width || header.height != height || header.pixel_size != sizeof(ColourStorage)) {
+        return nullptr;
+    }
+
+    RGBMatrix *pixels = new RGBMatrix(height, width);
+    file.read(reinterpret_cast<char *>(pixels->data()), pixels->size() * sizeof(ColourStorage));
+
+    // Truncated file
+    if (!file) {
+        delete pixels;
+        return nullptr;
+    }
+    return new RGBImage(width, height, pixels);
+}
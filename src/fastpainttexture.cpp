@@ -0,0 +1,332 @@
+#include <stdexcept>
+
+#include "fastpainttexture.hpp"
+
+namespace {
+    /**
+     * @param buffer: Buffer to check
+     * @param name: Name of the buffer, used in error messages
+     *
+     * @throws std::invalid_argument: If the buffer has no pixels or its rows overlap
+    */
+    template <typename Buffer>
+    void check_buffer(const Buffer &buffer, const std::string &name) {
+        if (buffer.data == nullptr || buffer.width <= 0 || buffer.height <= 0 ||
+            buffer.stride < (size_t) buffer.width * FastPaintAPI::get_bytes_per_pixel(buffer.format)) {
+            throw std::invalid_argument("Invalid " + name + " buffer.");
+        }
+    }
+
+    /**
+     * @param buffer: Output buffer (can be nullptr)
+     * @param width: Expected width
+     * @param height: Expected height
+     * @param colour: True if the buffer must have a colour format, false if it must be GRAY8
+     * @param name: Name of the buffer, used in error messages
+    */
+    void check_output(const FastPaintAPI::ImageBuffer *buffer, const int width, const int height, const bool colour, const std::string &name) {
+        if (buffer == nullptr) {
+            return;
+        }
+        check_buffer(*buffer, name);
+        if (buffer->width != width || buffer->height != height) {
+            throw std::invalid_argument("Invalid " + name + " buffer: dimensions do not match the input image.");
+        }
+        if ((buffer->format == FastPaintAPI::PixelFormat::GRAY8) == colour) {
+            throw std::invalid_argument("Invalid " + name + " buffer: expected a " + (colour ? "colour" : "GRAY8") + " format.");
+        }
+    }
+
+    /**
+     * @param view: Pixels to convert
+     *
+     * @return: RGB image of the pixels. This image must be freed
+    */
+    RGBImage *to_rgb_image(const FastPaintAPI::ImageView &view) {
+        RGBImage *image = new RGBImage(view.width, view.height, new RGBMatrix(view.height, view.width));
+        int bytes_per_pixel = FastPaintAPI::get_bytes_per_pixel(view.format);
+
+        for (int y = 0; y < view.height; y++) {
+            const uint8_t *row = view.data + y * view.stride;
+            for (int x = 0; x < view.width; x++) {
+                const uint8_t *pixel = row + x * bytes_per_pixel;
+                switch (view.format) {
+                    case FastPaintAPI::PixelFormat::GRAY8:
+                        image->set_pixel(x, y, Vector3f(pixel[0], pixel[0], pixel[0]));
+                        break;
+                    case FastPaintAPI::PixelFormat::RGB8:
+                    case FastPaintAPI::PixelFormat::RGBA8:
+                        image->set_pixel(x, y, Vector3f(pixel[0], pixel[1], pixel[2]));
+                        break;
+                    case FastPaintAPI::PixelFormat::BGR8:
+                    case FastPaintAPI::PixelFormat::BGRA8:
+                        image->set_pixel(x, y, Vector3f(pixel[2], pixel[1], pixel[0]));
+                        break;
+                }
+            }
+        }
+        return image;
+    }
+
+    /**
+     * Writes an RGB image to a colour buffer. Channels are truncated like RGBImage::to_cv_mat.
+    */
+    void write_rgb_image(const RGBImage *image, const FastPaintAPI::ImageBuffer &buffer) {
+        int bytes_per_pixel = FastPaintAPI::get_bytes_per_pixel(buffer.format);
+        bool bgr = buffer.format == FastPaintAPI::PixelFormat::BGR8 || buffer.format == FastPaintAPI::PixelFormat::BGRA8;
+
+        for (int y = 0; y < buffer.height; y++) {
+            uint8_t *row = buffer.data + y * buffer.stride;
+            for (int x = 0; x < buffer.width; x++) {
+                uint8_t *pixel = row + x * bytes_per_pixel;
+                Vector3f colour = image->get_pixel(x, y);
+
+                pixel[0] = static_cast<uint8_t>(bgr ? colour.z() : colour.x());
+                pixel[1] = static_cast<uint8_t>(colour.y());
+                pixel[2] = static_cast<uint8_t>(bgr ? colour.x() : colour.z());
+                if (bytes_per_pixel == 4) {
+                    pixel[3] = 255;
+                }
+            }
+        }
+    }
+
+    /**
+     * Writes a gray-scale image to a GRAY8 buffer. Values are truncated like GrayImage::to_cv_mat.
+    */
+    void write_gray_image(const GrayImage *image, const FastPaintAPI::ImageBuffer &buffer) {
+        for (int y = 0; y < buffer.height; y++) {
+            uint8_t *row = buffer.data + y * buffer.stride;
+            for (int x = 0; x < buffer.width; x++) {
+                row[x] = static_cast<uint8_t>(image->get_pixel(x, y));
+            }
+        }
+    }
+
+    /**
+     * @param view: GRAY8 texture pixels
+     *
+     * @return: Texture with a copy of the pixels
+    */
+    Texture *to_texture(const FastPaintAPI::ImageView &view) {
+        if (view.format != FastPaintAPI::PixelFormat::GRAY8) {
+            throw std::invalid_argument("Invalid brush texture buffer: expected GRAY8.");
+        }
+        // Wraps the caller's pixels without copying. Texture copies them
+        cv::Mat image(view.height, view.width, CV_8UC1, const_cast<uint8_t *>(view.data), view.stride);
+        return new Texture(view.width, view.height, image);
+    }
+}
+
+namespace {
+    /**
+     * Validates the arguments of a painting.
+     *
+     * @return: Shader for the textured output (nullptr if there is none)
+     *
+     * @throws std::invalid_argument: If an argument is invalid (see FastPaintAPI::paint)
+    */
+    std::unique_ptr<Shader> prepare_painting(const FastPaintAPI::ImageView &input, const std::shared_ptr<const BrushTextures> &brushes,
+                                             const FastPaintAPI::PaintOptions &options, const FastPaintAPI::ImageBuffer *texture,
+                                             const FastPaintAPI::ImageBuffer *paint, const FastPaintAPI::ImageBuffer *height) {
+        check_buffer(input, "input");
+        check_output(texture, input.width, input.height, true, "texture");
+        check_output(paint, input.width, input.height, true, "paint");
+        check_output(height, input.width, input.height, false, "height");
+        if (brushes == nullptr) {
+            throw std::invalid_argument("Unable to paint: no brush textures.");
+        }
+        if (options.importance.strength < 0.0f) {
+            throw std::invalid_argument("Unable to paint: the importance strength must not be negative.");
+        }
+        if (options.importance.source == ImportanceSource::MASK && (options.importance.mask == nullptr || 
+            options.importance.mask->get_width() != input.width || options.importance.mask->get_height() != input.height)) {
+            throw std::invalid_argument("Unable to paint: the importance mask does not match the input image.");
+        }
+
+        // Only created if the textured image is needed
+        std::unique_ptr<Shader> shader;
+        if (texture != nullptr) {
+            shader = FastPaintAPI::create_shader(options.shader);
+            if (shader == nullptr) {
+                throw std::invalid_argument("Unable to paint: unknown shader " + options.shader + ".");
+            }
+        }
+        return shader;
+    }
+
+    /**
+     * @param buffer: Output buffer (can be nullptr)
+     *
+     * @return: Copy of the buffer description, with nullptr data if there is no buffer
+    */
+    FastPaintAPI::ImageBuffer copy_output(const FastPaintAPI::ImageBuffer *buffer) {
+        if (buffer == nullptr) {
+            return FastPaintAPI::ImageBuffer {nullptr, 0, 0, 0, FastPaintAPI::PixelFormat::GRAY8};
+        }
+        return *buffer;
+    }
+
+    /**
+     * Paints an image into the output buffers. Outputs with nullptr data are skipped.
+     *
+     * @param input_image: Image to paint
+     * @param token: Cancellation token (can be nullptr)
+     *
+     * @return: False if the painting was cancelled (then the outputs are not written)
+    */
+    bool run_painting(std::unique_ptr<RGBImage> input_image, const std::shared_ptr<const BrushTextures> &brushes, const FastPaintAPI::PaintOptions &options,
+                      Shader *shader, const FastPaintAPI::ImageBuffer &texture, const FastPaintAPI::ImageBuffer &paint,
+                      const FastPaintAPI::ImageBuffer &height, const ProgressCallback &progress, const int progress_interval,
+                      const Parallel::CancellationToken *token) {
+        // The painter frees the input image
+        FastPaintTexture painter(input_image.release(), brushes);
+        painter.set_budget(options.budget);
+        painter.set_distant_lights(options.distant_lights);
+        painter.set_stroke_placement(options.stroke_placement);
+        painter.set_importance(options.importance);
+        painter.set_stroke_order(options.stroke_order);
+        painter.set_cancellation_token(token);
+        if (progress) {
+            painter.set_progress_callback(progress, progress_interval);
+        }
+
+        std::vector<Light> lights = options.lights.empty() ? painter.get_default_lights() : options.lights;
+        Vector3f view_pos = options.view_provided ? options.view_pos : painter.get_default_view_pos();
+
+        RGBImage *texture_output, *paint_output;
+        GrayImage *height_output;
+        std::tie(texture_output, paint_output, height_output) = painter.fast_paint_texture(shader, view_pos, lights);
+
+        // Freed even if writing an output throws
+        std::unique_ptr<RGBImage> texture_image(texture_output), paint_image(paint_output);
+        std::unique_ptr<GrayImage> height_map(height_output);
+
+        if (paint_image == nullptr) {
+            return false;
+        }
+        if (texture.data != nullptr) {
+            write_rgb_image(texture_image.get(), texture);
+        }
+        if (paint.data != nullptr) {
+            write_rgb_image(paint_image.get(), paint);
+        }
+        if (height.data != nullptr) {
+            write_gray_image(height_map.get(), height);
+        }
+        return true;
+    }
+}
+
+namespace FastPaintAPI {
+    int get_bytes_per_pixel(const PixelFormat format) {
+        switch (format) {
+            case PixelFormat::GRAY8:
+                return 1;
+            case PixelFormat::RGB8:
+            case PixelFormat::BGR8:
+                return 3;
+            case PixelFormat::RGBA8:
+            case PixelFormat::BGRA8:
+                return 4;
+        }
+        return 0;
+    }
+
+    std::shared_ptr<const BrushTextures> create_brushes(const ImageView &height_texture, const ImageView &opacity_texture) {
+        check_buffer(height_texture, "height texture");
+        check_buffer(opacity_texture, "opacity texture");
+
+        Texture *height = to_texture(height_texture);
+        Texture *opacity;
+        try {
+            opacity = to_texture(opacity_texture);
+        } catch (const std::invalid_argument &) {
+            delete height;
+            throw;
+        }
+        return std::make_shared<const BrushTextures>(height, opacity);
+    }
+
+    std::shared_ptr<const GrayImage> create_importance_mask(const ImageView &mask, const int width, const int height) {
+        check_buffer(mask, "importance mask");
+        if (mask.format != PixelFormat::GRAY8) {
+            throw std::invalid_argument("Invalid importance mask buffer: expected GRAY8.");
+        }
+        if (width <= 0 || height <= 0) {
+            throw std::invalid_argument("Invalid importance mask dimensions.");
+        }
+        // Wraps the caller's pixels without copying. The mask copies them
+        cv::Mat image(mask.height, mask.width, CV_8UC1, const_cast<uint8_t *>(mask.data), mask.stride);
+        return Importance::create_mask(image, width, height);
+    }
+
+    std::unique_ptr<Shader> create_shader(const std::string &name) {
+        if (name == "blinn-phong") {
+            return std::make_unique<BlinnPhongShader>();
+        }
+        else if (name == "lambertian") {
+            return std::make_unique<LambertianShader>();
+        }
+        else if (name == "oren-nayar") {
+            return std::make_unique<OrenNayarShader>();
+        }
+        else if (name == "toon") {
+            return std::make_unique<ToonShader>();
+        }
+        else if (name == "normal") {
+            return std::make_unique<NormalShader>();
+        }
+        return nullptr;
+    }
+
+    PaintJob::PaintJob(std::shared_ptr<Parallel::CancellationToken> token, std::shared_future<JobStatus> result) {
+        this->token = token;
+        this->result = result;
+    }
+
+    PaintJob::~PaintJob() {
+        this->token->cancel();
+        this->result.wait();
+    }
+
+    void PaintJob::cancel() {
+        this->token->cancel();
+    }
+
+    bool PaintJob::wait_for(std::chrono::milliseconds timeout) const {
+        return this->result.wait_for(timeout) == std::future_status::ready;
+    }
+
+    JobStatus PaintJob::wait() const {
+        return this->result.get();
+    }
+
+    void paint(const ImageView &input, const std::shared_ptr<const BrushTextures> &brushes, const PaintOptions &options,
+               const ImageBuffer *texture, const ImageBuffer *paint, const ImageBuffer *height) {
+        std::unique_ptr<Shader> shader = prepare_painting(input, brushes, options, texture, paint, height);
+
+        run_painting(std::unique_ptr<RGBImage>(to_rgb_image(input)), brushes, options, shader.get(), copy_output(texture), copy_output(paint),
+            copy_output(height), ProgressCallback(), 0, nullptr);
+    }
+
+    std::unique_ptr<PaintJob> paint_async(const ImageView &input, const std::shared_ptr<const BrushTextures> &brushes,
+                                          const PaintOptions &options, const ImageBuffer *texture, const ImageBuffer *paint,
+                                          const ImageBuffer *height, ProgressCallback progress, int progress_interval) {
+        std::shared_ptr<Shader> shader = prepare_painting(input, brushes, options, texture, paint, height);
+        std::shared_ptr<Parallel::CancellationToken> token = std::make_shared<Parallel::CancellationToken>();
+
+        // Everything the job needs is copied, except for the output pixels
+        std::unique_ptr<RGBImage> input_image(to_rgb_image(input));
+        ImageBuffer texture_buffer = copy_output(texture), paint_buffer = copy_output(paint), height_buffer = copy_output(height);
+
+        // The job owns the input image from here on, so it is freed if the job cannot be started
+        std::shared_future<JobStatus> result = std::async(std::launch::async, [=, input_image = std::move(input_image)]() mutable {
+            bool completed = run_painting(std::move(input_image), brushes, options, shader.get(), texture_buffer, paint_buffer, height_buffer, 
+                progress, progress_interval, token.get());
+            return completed ? JobStatus::COMPLETED : JobStatus::CANCELLED;
+        }).share();
+
+        return std::make_unique<PaintJob>(token, result);
+    }
+}
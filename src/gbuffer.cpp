@@ -0,0 +1,102 @@
+#include <cstdint>
+#include <fstream>
+
+#include "gbuffer.hpp"
+
+using namespace std;
+
+namespace {
+    // Identifies G-buffer files. Bump the version whenever the layout changes
+    const char gbuffer_magic[4] = {'F', 'P', 'T', 'G'};
+    const uint32_t gbuffer_version = 1;
+}
+
+namespace GBuffer {
+    bool save(const std::string &path, const RGBImage *albedo, const GrayImage *height_map) {
+        int width = albedo->get_width();
+        int height = albedo->get_height();
+
+        if (height_map->get_width() != width || height_map->get_height() != height) {
+            throw std::invalid_argument("Cannot save G-buffer: albedo and height map dimensions do not match");
+        }
+
+        std::ofstream file(path, std::ios::binary);
+        if (!file) {
+            return false;
+        }
+
+        file.write(gbuffer_magic, sizeof(gbuffer_magic));
+        file.write(reinterpret_cast<const char *>(&gbuffer_version), sizeof(gbuffer_version));
+        file.write(reinterpret_cast<const char *>(&width), sizeof(width));
+        file.write(reinterpret_cast<const char *>(&height), sizeof(height));
+
+        // Both planes are stored in row-major order, one row at a time
+        std::vector<float> row(3 * width);
+        Vector3f pixel;
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                pixel = albedo->get_pixel(x, y);
+                row[3 * x] = pixel.x();
+                row[3 * x + 1] = pixel.y();
+                row[3 * x + 2] = pixel.z();
+            }
+            file.write(reinterpret_cast<const char *>(row.data()), 3 * width * sizeof(float));
+        }
+
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                row[x] = height_map->get_pixel(x, y);
+            }
+            file.write(reinterpret_cast<const char *>(row.data()), width * sizeof(float));
+        }
+        return static_cast<bool>(file);
+    }
+
+    std::tuple<RGBImage*, GrayImage*> load(const std::string &path, const int width, const int height) {
+        std::tuple<RGBImage*, GrayImage*> missing = std::tuple<RGBImage*, GrayImage*>(nullptr, nullptr);
+
+        std::ifstream file(path, std::ios::binary);
+        if (!file) {
+            return missing;
+        }
+
+        char magic[4];
+        uint32_t version;
+        int file_width, file_height;
+        file.read(magic, sizeof(magic));
+        file.read(reinterpret_cast<char *>(&version), sizeof(version));
+        file.read(reinterpret_cast<char *>(&file_width), sizeof(file_width));
+        file.read(reinterpret_cast<char *>(&file_height), sizeof(file_height));
+
+        if (!file || !std::equal(magic, magic + 4, gbuffer_magic) || version != gbuffer_version ||
+            file_width != width || file_height != height) {
+            return missing;
+        }
+
+        RGBImage *albedo = new RGBImage(width, height, new RGBMatrix(height, width));
+        GrayImage *height_map = new GrayImage(width, height, new GrayMatrix(height, width));
+
+        std::vector<float> row(3 * width);
+        for (int y = 0; y < height; y++) {
+            file.read(reinterpret_cast<char *>(row.data()), 3 * width * sizeof(float));
+            for (int x = 0; x < width; x++) {
+                albedo->set_pixel(x, y, Vector3f(row[3 * x], row[3 * x + 1], row[3 * x + 2]));
+            }
+        }
+
+        for (int y = 0; y < height; y++) {
+            file.read(reinterpret_cast<char *>(row.data()), width * sizeof(float));
+            for (int x = 0; x < width; x++) {
+                height_map->set_pixel(x, y, row[x]);
+            }
+        }
+
+        // Truncated file
+        if (!file) {
+            delete albedo;
+            delete height_map;
+            return missing;
+        }
+        return std::tuple<RGBImage*, GrayImage*>(albedo, height_map);
+    }
+}
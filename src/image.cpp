@@ -1,26 +1,12 @@
 #include <opencv2/opencv.hpp>
 
 #include "image.hpp"
+#include "parallel.hpp"
+#include "simd.hpp"
 
 using namespace std;
 
 namespace ImageUtil {
-    float get_pixel(const GrayMatrix *image, const int x, const int y) {
-        return (*image)(y, x);
-    }
-
-    void set_pixel(GrayMatrix *image, const int x, const int y, const float colour) {
-        (*image)(y, x) = colour;
-    }
-
-    Vector3f get_pixel(const RGBMatrix *image, const int x, const int y) {
-        return (*image)(y, x);
-    }
-
-    void set_pixel(RGBMatrix *image, const int x, const int y, const Vector3f colour) {
-        (*image)(y, x) = colour;
-    }
-
     Vector3f alpha_blend(const Vector3f c1, const Vector3f c2, const float alpha) {
             return (alpha * c1 + (1 - alpha) * c2).cwiseMin(255.0f).cwiseMax(0.0f);
         }
@@ -73,10 +59,9 @@ cv::Mat *GrayImage::to_cv_mat() {
     return cv_image;
 }
 
-std::tuple<Vector2f, float> GrayImage::compute_gradient(const int x, const int y, const HorizontalSobelKernel *sobel_x, const VerticalSobelKernel *sobel_y) {
+Vector2f GrayImage::convolve_sobel(const int x, const int y, const HorizontalSobelKernel *sobel_x, const VerticalSobelKernel *sobel_y) const {
     Vector2f grad = Vector2f::Zero();
-    Vector3f pixel;
-    float grad_mag, intensity;
+    float intensity;
     int image_x, image_y;
 
     for (int j = 0; j < sobel_x->get_len(); j++) {
@@ -97,6 +82,13 @@ std::tuple<Vector2f, float> GrayImage::compute_gradient(const int x, const int y
             grad[1] += intensity * sobel_y->get_value(i, j);
         }
     }
+    return grad;
+}
+
+std::tuple<Vector2f, float> GrayImage::compute_gradient(const int x, const int y, const HorizontalSobelKernel *sobel_x, const VerticalSobelKernel *sobel_y) {
+    Vector2f grad = this->convolve_sobel(x, y, sobel_x, sobel_y);
+    float grad_mag;
+
     grad.normalize();
     // Compute the magnitude of the gradient
     grad_mag = grad.norm();
@@ -104,25 +96,154 @@ std::tuple<Vector2f, float> GrayImage::compute_gradient(const int x, const int y
     return std::tuple<Vector2f, float>(grad, grad_mag);
 }
 
-RGBImage *GrayImage::compute_normals(const HorizontalSobelKernel *sobel_x, const VerticalSobelKernel *sobel_y) {
-    Vector3f normal;
-    Vector2f grad;
-    float grad_mag;
+VectorMatrix *GrayImage::compute_gradients(const HorizontalSobelKernel *sobel_x, const VerticalSobelKernel *sobel_y) {
+    VectorMatrix *gradients = new VectorMatrix(this->height, this->width);
 
-    RGBMatrix *normals = new RGBMatrix(this->height, this->width);
+    Parallel::parallel_for_tiles(this->width, this->height, 64, [&](int x_begin, int y_begin, int x_end, int y_end) {
+        Vector2f grad;
+        float grad_mag;
 
-    for (int y = 0; y < this->height; y++) {
-        for (int x = 0; x < this->width; x++) {
-            // Get the unit vector of gradient (gx, gy) and gradient magnitutde (unused)
-            std::tie<Vector2f, float>(grad, grad_mag) = this->compute_gradient(x, y, sobel_x, sobel_y);
+        // Columns are contiguous in memory
+        for (int x = x_begin; x < x_end; x++) {
+            for (int y = y_begin; y < y_end; y++) {
+                std::tie<Vector2f, float>(grad, grad_mag) = this->compute_gradient(x, y, sobel_x, sobel_y);
+
+                // Eigen uses (row, col) indicies
+                (*gradients)(y, x) = Vector3f(grad.x(), grad.y(), grad_mag);
+            }
+        }
+    });
+    return gradients;
+}
 
-            normal = Vector3f(-grad.x(), -grad.y(), 1).normalized();
+VectorMatrix *GrayImage::compute_normals(const HorizontalSobelKernel *sobel_x, const VerticalSobelKernel *sobel_y) {
+    VectorMatrix *normals = new VectorMatrix(this->height, this->width);
 
-            ImageUtil::set_pixel(normals, x, y, normal);
+    #if defined(PRECISION_UINT8) || defined(PRECISION_UINT16)
+        Parallel::parallel_for_tiles(this->width, this->height, 64, [&](int x_begin, int y_begin, int x_end, int y_end) {
+            Vector3f normal;
+            Vector2f grad;
+            float grad_mag;
+
+            for (int y = y_begin; y < y_end; y++) {
+                for (int x = x_begin; x < x_end; x++) {
+                    // Get the unit vector of gradient (gx, gy) and gradient magnitutde (unused)
+                    std::tie<Vector2f, float>(grad, grad_mag) = this->compute_gradient(x, y, sobel_x, sobel_y);
+
+                    normal = Vector3f(-grad.x(), -grad.y(), 1).normalized();
+
+                    // Eigen uses (row, col) indicies
+                    (*normals)(y, x) = normal;
+                }
+            }
+        });
+    #else
+        float kx[9], ky[9];
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++) {
+                kx[i * 3 + j] = sobel_x->get_value(i, j);
+                ky[i * 3 + j] = sobel_y->get_value(i, j);
+            }
         }
-    }
+
+        // Single precision storage is read directly. Columns are contiguous (column-major)
+        const Simd::KernelTable &kernels = Simd::get();
+        const float *gray = this->image->data();
+        float *normal_data = normals->data()->data();
+
+        Parallel::parallel_for_tiles(this->width, this->height, 64, [&](int x_begin, int y_begin, int x_end, int y_end) {
+            for (int x = x_begin; x < x_end; x++) {
+                kernels.sobel_normals(gray, this->width, this->height, kx, ky, x, y_begin, y_end, 
+                    normal_data + 3 * ((size_t) x * this->height + y_begin));
+            }
+        });
+    #endif
     
-    return new RGBImage(this->width, this->height, normals);
+    return normals;
+}
+
+void SummedAreaTable::compute(const GrayImage *image) {
+    this->width = image->get_width();
+    this->height = image->get_height();
+    size_t column_len = this->height + 1;
+    this->sums.resize(column_len * (this->width + 1));
+
+    // The first row and column are the only entries that are not overwritten
+    std::fill(this->sums.begin(), this->sums.begin() + column_len, 0.0);
+    for (int x = 1; x <= this->width; x++) {
+        this->sums[x * column_len] = 0.0;
+    }
+
+    // Every thread sums a band of columns as if the image started at the band (columns are contiguous in memory)...
+    int num_bands = std::max(std::min(Parallel::get_num_threads(), this->width), 1);
+    int band_width = (this->width + num_bands - 1) / num_bands;
+    Parallel::parallel_for(0, this->width, band_width, [&](int x_begin, int x_end) {
+        for (int x = x_begin; x < x_end; x++) {
+            double *column = this->sums.data() + (x + 1) * column_len;
+            double sum = 0.0;
+            if (x == x_begin) {
+                for (int y = 0; y < this->height; y++) {
+                    sum += image->get_pixel(x, y);
+                    column[y + 1] = sum;
+                }
+                continue;
+            }
+            const double *previous = column - column_len;
+            for (int y = 0; y < this->height; y++) {
+                sum += image->get_pixel(x, y);
+                column[y + 1] = previous[y + 1] + sum;
+            }
+        }
+    });
+    if (num_bands == 1) {
+        return;
+    }
+
+    // ...then the last column of every band is completed in order...
+    for (int x_begin = band_width; x_begin < this->width; x_begin += band_width) {
+        const double *offset = this->sums.data() + x_begin * column_len;
+        double *last = this->sums.data() + std::min(x_begin + band_width, this->width) * column_len;
+        for (size_t y = 1; y < column_len; y++) {
+            last[y] += offset[y];
+        }
+    }
+
+    // ...and the other columns of every band are offset by the last column of the band before it
+    Parallel::parallel_for(band_width, this->width, band_width, [&](int x_begin, int x_end) {
+        const double *offset = this->sums.data() + x_begin * column_len;
+        for (int x = x_begin + 1; x < x_end; x++) {
+            double *column = this->sums.data() + x * column_len;
+            for (size_t y = 1; y < column_len; y++) {
+                column[y] += offset[y];
+            }
+        }
+    });
+}
+
+double SummedAreaTable::get_sum(int x_begin, int y_begin, int x_end, int y_end) const {
+    x_begin = std::max(x_begin, 0);
+    y_begin = std::max(y_begin, 0);
+    x_end = std::min(x_end, this->width);
+    y_end = std::min(y_end, this->height);
+    if (x_begin >= x_end || y_begin >= y_end) {
+        return 0.0;
+    }
+    return this->get_entry(x_end, y_end) - this->get_entry(x_begin, y_end) - 
+        this->get_entry(x_end, y_begin) + this->get_entry(x_begin, y_begin);
+}
+
+GrayImage *GrayImage::compute_edges(const HorizontalSobelKernel *sobel_x, const VerticalSobelKernel *sobel_y) const {
+    GrayMatrix *edges = new GrayMatrix(this->height, this->width);
+
+    Parallel::parallel_for_tiles(this->width, this->height, 64, [&](int x_begin, int y_begin, int x_end, int y_end) {
+        // Columns are contiguous in memory
+        for (int x = x_begin; x < x_end; x++) {
+            for (int y = y_begin; y < y_end; y++) {
+                ImageUtil::set_pixel(edges, x, y, this->convolve_sobel(x, y, sobel_x, sobel_y).norm());
+            }
+        }
+    });
+    return new GrayImage(this->width, this->height, edges);
 }
 
 RGBImage::RGBImage(int width, int height, Vector3f colour) {
@@ -176,12 +297,51 @@ RGBImage* RGBImage::gaussian_blur(const GaussianKernel *kernel) {
     // Creates a blank output image with the rewquired dimensions
     RGBImage *blurred_image = new RGBImage(this->width, this->height, new RGBMatrix(this->height, this->width));
 
-    // Uses convoltion with a Gaussian kernel to compute the output pixels
-    for (int y = 0; y < this->height; y++) {
-        for (int x = 0; x < this->width; x++) {
-            blurred_image->set_pixel(x, y, this->convolve(x, y, kernel));
-        }
-    }
+    #if defined(PRECISION_UINT8) || defined(PRECISION_UINT16)
+        // Uses convoltion with a Gaussian kernel to compute the output pixels
+        Parallel::parallel_for_tiles(this->width, this->height, 64, [&](int x_begin, int y_begin, int x_end, int y_end) {
+            for (int y = y_begin; y < y_end; y++) {
+                for (int x = x_begin; x < x_end; x++) {
+                    blurred_image->set_pixel(x, y, this->convolve(x, y, kernel));
+                }
+            }
+        });
+    #else
+        // Columns are contiguous (column-major), so every kernel value adds a scaled run of a source 
+        // column to the tile column. The taps are accumulated in the same order as convolve()
+        const Simd::KernelTable &kernels = Simd::get();
+        const float *pixels = this->image->data()->data();
+        float *blurred_pixels = blurred_image->get_image()->data()->data();
+
+        Parallel::parallel_for_tiles(this->width, this->height, 64, [&](int x_begin, int y_begin, int x_end, int y_end) {
+            int image_x, row_begin, row_end;
+
+            for (int x = x_begin; x < x_end; x++) {
+                float *column = blurred_pixels + 3 * (size_t) x * this->height;
+                std::fill(column + 3 * y_begin, column + 3 * y_end, 0.0f);
+
+                for (int j = 0; j < kernel->get_len(); j++) {
+                    for (int i = 0; i < kernel->get_len(); i++) {
+                        image_x = x + i - kernel->get_centre_x();
+                        if (image_x < 0 || image_x >= this->width) {
+                            continue;
+                        }
+
+                        // Rows whose pixel (image_x, y + j - centre_y) is inside the image
+                        row_begin = std::max(y_begin, kernel->get_centre_y() - j);
+                        row_end = std::min(y_end, this->height + kernel->get_centre_y() - j);
+                        if (row_begin >= row_end) {
+                            continue;
+                        }
+
+                        kernels.axpy(column + 3 * row_begin, 
+                            pixels + 3 * ((size_t) image_x * this->height + row_begin + j - kernel->get_centre_y()),
+                            kernel->get_value(i, j), 3 * (row_end - row_begin));
+                    }
+                }
+            }
+        });
+    #endif
     return blurred_image;
 }
 
@@ -218,48 +378,81 @@ Vector3f RGBImage::convolve(const int x, const int y, const GaussianKernel *kern
     return Vector3f(blurred_r, blurred_g, blurred_b);
 }
 
-GrayImage *RGBImage::luminosity() {
-    GrayMatrix *luminosity = new GrayMatrix(this->height, this->width);
-    
-    Vector3f pixel;
-    for (int y = 0; y < this->height; y++) {
-        for (int x = 0; x < this->width; x++) {
-            pixel = get_pixel(x, y);
-
-            // Compute the intensity of the current pixel
-            // The constants reflect how sensitive the human-eye is to each colour channel
-            ImageUtil::set_pixel(luminosity, x, y, 0.2989 * pixel.x() + 0.5870 * pixel.y() * 0.1140 * pixel.z());
-        }
+void RGBImage::preprocess(const RGBImage *compare_image, GrayImage *differences, GrayImage *luminosity) const {
+    // Ensure the images have the same dimensions
+    if ((differences != nullptr && (this->width != compare_image->get_width() || this->height != compare_image->get_height() ||
+            this->width != differences->get_width() || this->height != differences->get_height())) || 
+        (luminosity != nullptr && (this->width != luminosity->get_width() || this->height != luminosity->get_height()))) {
+        throw std::invalid_argument("Cannot preprocess images with different dimensions");
     }
-    return new GrayImage(this->width, this->height, luminosity);
+
+    // All images share the same (column-major) layout, so pixels are visited in memory order
+    const ColourStorage *pixels = this->image->data();
+    const ColourStorage *compare_pixels = differences != nullptr ? compare_image->get_image()->data() : nullptr;
+    GrayStorage *difference_pixels = differences != nullptr ? differences->get_image()->data() : nullptr;
+    GrayStorage *luminosity_pixels = luminosity != nullptr ? luminosity->get_image()->data() : nullptr;
+
+    #if defined(PRECISION_UINT8) || defined(PRECISION_UINT16)
+        Parallel::parallel_for(0, this->width * this->height, 1 << 14, [&](int begin, int end) {
+            Vector3f pixel;
+            for (int i = begin; i < end; i++) {
+                pixel = ImageUtil::load_colour(pixels[i]);
+
+                // Compute the distance between the current pixel values
+                // | (r1, g1, b1) - (r2, g2, b2) | = sqrt((r1 - r2)^2 + (g1 - g2)^2 + (b1 - b2)^2)
+                if (difference_pixels != nullptr) {
+                    difference_pixels[i] = static_cast<GrayStorage>((pixel - ImageUtil::load_colour(compare_pixels[i])).norm());
+                }
+
+                // Compute the intensity of the current pixel
+                // The constants reflect how sensitive the human-eye is to each colour channel
+                if (luminosity_pixels != nullptr) {
+                    luminosity_pixels[i] = static_cast<GrayStorage>(0.2989f * pixel.x() + 0.5870f * pixel.y() + 0.1140f * pixel.z());
+                }
+            }
+        });
+    #else
+        // Single precision storage is passed to the kernels as packed floats
+        const Simd::KernelTable &kernels = Simd::get();
+
+        Parallel::parallel_for(0, this->width * this->height, 1 << 14, [&](int begin, int end) {
+            kernels.difference_luminosity(pixels[begin].data(), compare_pixels != nullptr ? compare_pixels[begin].data() : nullptr,
+                difference_pixels != nullptr ? difference_pixels + begin : nullptr, 
+                luminosity_pixels != nullptr ? luminosity_pixels + begin : nullptr, end - begin);
+        });
+    #endif
+}
+
+GrayImage *RGBImage::luminosity() {
+    GrayImage *luminosity = new GrayImage(this->width, this->height, new GrayMatrix(this->height, this->width));
+    this->preprocess(nullptr, nullptr, luminosity);
+    return luminosity;
 }
 
 Vector3f RGBImage::average_colour() {
-    Vector3f avg = Vector3f::Zero();
+    const int grain = 1 << 14;
+    const ColourStorage *pixels = this->image->data();
 
-    for (int y = 0; y < this->height; y++) {
-        for (int x = 0; x < this->width; x++) {
-            avg += this->get_pixel(x, y);
+    // Per-chunk sums are combined in order, so the result does not depend on the thread count
+    std::vector<Vector3d> sums(Parallel::get_num_chunks(0, this->width * this->height, grain), Vector3d::Zero());
+
+    Parallel::parallel_for(0, this->width * this->height, grain, [&](int begin, int end) {
+        Vector3d sum = Vector3d::Zero();
+        for (int i = begin; i < end; i++) {
+            sum += ImageUtil::load_colour(pixels[i]).cast<double>();
         }
+        sums[begin / grain] = sum;
+    });
+
+    Vector3d avg = Vector3d::Zero();
+    for (const Vector3d &sum : sums) {
+        avg += sum;
     }
-    return avg / (this->width * this->height);
+    return (avg / ((double) this->width * this->height)).cast<float>();
 }
 
 GrayImage* RGBImage::difference(const RGBImage *compare_image) {
-    // Ensure the images have the same dimensions
-    if (this->width != compare_image->get_width() || this->height != compare_image->get_height()) {
-        throw std::invalid_argument("Cannot compute the difference of images with different dimensions");
-    }
-
-    GrayMatrix *differences = new GrayMatrix(this->height, this->width);
-    float difference; 
-    for (int y = 0; y < this->height; y++) {
-        for (int x = 0; x < this->width; x++) {
-            // Compute the distance between the current pixel values
-            // | (r1, g1, b1) - (r2, g2, b2) | = sqrt((r1 - r2)^2 + (g1 - g2)^2 + (b1 - b2)^2)
-            difference = (this->get_pixel(x, y) - compare_image->get_pixel(x, y)).norm();
-            ImageUtil::set_pixel(differences, x, y, difference);
-        }
-    }
-    return new GrayImage(this->width, this->height, differences);
-}
\ No newline at end of file
+    GrayImage *differences = new GrayImage(this->width, this->height, new GrayMatrix(this->height, this->width));
+    this->preprocess(compare_image, differences, nullptr);
+    return differences;
+}
@@ -0,0 +1,32 @@
+#include <algorithm>
+#include <stdexcept>
+
+#include "importance.hpp"
+#include "parameters.hpp"
+
+float Importance::get_threshold_scale(const int x, const int y, const GrayImage *edges) const {
+    float importance;
+    switch (this->source) {
+        case ImportanceSource::EDGES:
+            importance = std::min(edges->get_pixel(x, y) / ProgramParameters::edge_importance, 1.0f);
+            break;
+        case ImportanceSource::MASK:
+            importance = this->mask->get_pixel(x, y) / 255.0f;
+            break;
+        default:
+            return 1.0f;
+    }
+    return 1.0f + this->strength * (1.0f - importance);
+}
+
+std::shared_ptr<const GrayImage> Importance::create_mask(const cv::Mat &image, const int width, const int height) {
+    if (image.empty() || image.type() != CV_8UC1) {
+        throw std::invalid_argument("Invalid importance mask: expected a gray-scale image.");
+    }
+
+    cv::Mat resized = image;
+    if (image.cols != width || image.rows != height) {
+        cv::resize(image, resized, cv::Size(width, height), 0, 0, cv::INTER_AREA);
+    }
+    return std::make_shared<const GrayImage>(width, height, resized);
+}
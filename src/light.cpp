@@ -0,0 +1,41 @@
+#include <algorithm>
+
+#include "light.hpp"
+
+LightGrid::LightGrid(const std::vector<Light> &lights, int width, int height, int tile_size) {
+    this->tile_size = tile_size;
+    this->tiles_x = (width + tile_size - 1) / tile_size;
+    this->tiles_y = (height + tile_size - 1) / tile_size;
+    this->num_scene_lights = lights.size();
+    this->tiles.resize(this->tiles_x * this->tiles_y);
+
+    float x_min, x_max, y_min, y_max, dx, dy;
+    Vector3f position;
+
+    for (int ty = 0; ty < this->tiles_y; ty++) {
+        for (int tx = 0; tx < this->tiles_x; tx++) {
+            // Pixel centres covered by the tile
+            x_min = tx * tile_size;
+            x_max = std::min((tx + 1) * tile_size, width) - 1;
+            y_min = ty * tile_size;
+            y_max = std::min((ty + 1) * tile_size, height) - 1;
+
+            for (const Light &light : lights) {
+                // Lights with unlimited range reach every tile
+                if (light.get_range() <= 0.0f) {
+                    this->tiles[ty * this->tiles_x + tx].push_back(light);
+                    continue;
+                }
+
+                // Squared distance from the light to the closest point of the tile
+                position = light.get_position();
+                dx = position.x() - std::min(std::max(position.x(), x_min), x_max);
+                dy = position.y() - std::min(std::max(position.y(), y_min), y_max);
+
+                if (dx * dx + dy * dy + position.z() * position.z() < light.get_range() * light.get_range()) {
+                    this->tiles[ty * this->tiles_x + tx].push_back(light);
+                }
+            }
+        }
+    }
+}
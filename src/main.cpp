@@ -1,139 +1,900 @@
 #include <iostream>
 #include <opencv2/opencv.hpp>
 #include <string>
+#include <sstream>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
 #include <Eigen/Dense>
 
+#include "benchmark.hpp"
+#include "fastpainttexture.hpp"
 #include "paint.hpp"
 #include "shader.hpp"
 #include "light.hpp"
+#include "cache.hpp"
+#include "gbuffer.hpp"
+#include "strokelist.hpp"
+#include "pipeline.hpp"
+#include "parallel.hpp"
+#include "simd.hpp"
 
 using namespace std;
 using namespace Eigen;
 
-int main(int argc, const char **argv) {
-    // Name of the input file, texture file (final output), paint file (output),and the height file (output)
-    std::string input_file, texture_file, paint_file, height_file;
-    // Path to the input and output image directories
+/**
+ * Command line options shared by every input image of a run
+*/
+struct Options {
+    // Path to the input, output and cache directories. Set with --input-dir, --brush-dir, --output-dir and --cache-dir
     std::string input_path = "../imgs/";
     std::string stroke_texture_path = "../stroke-textures/";
     std::string texture_path = "../texture/";
     std::string paint_path = "../paint/";
     std::string height_path = "../height/";
-    
+    std::string cache_path = "../cache/";
+    std::string stroke_path = "../strokes/";
+
+    // Names of the input files (final outputs are named after them)
+    std::vector<std::string> input_files;
     // Input shader
     std::string input_shader;
 
+    // Reuse cached intermediates and results (see Cache), and the size cap of the cache in megabytes
+    bool use_cache = true;
+    double cache_size_mb = 2048.0;
+    // Lights and view position. Defaults are used if they are not provided
+    std::vector<Light> lights;
+    Vector3f view_pos;
+    bool view_provided = false;
+
+    // Progressive output: publish a textured preview after every layer and every preview_strokes strokes
+    bool progressive = false;
+    int preview_strokes = 0;
+
+    // Time and stroke budget of the painting (unlimited by default)
+    PaintBudget budget;
+
+    // How the stroke seeds of each layer are found
+    StrokePlacement stroke_placement = StrokePlacement::QUADTREE;
+
+    // Importance of the pixels. The mask is loaded from importance_mask_path and resized to every input
+    Importance importance;
+    std::string importance_mask_path;
+    cv::Mat importance_mask;
+
+    // Order the strokes of each layer are rendered in
+    StrokeOrder stroke_order = StrokeOrder::RASTER;
+    // Compare the stroke orders on the first input instead of painting
+    bool benchmark_stroke_order = false;
+
+    // Save the strokes of the painting, or render previously saved strokes at the given scale
+    bool export_strokes = false;
+    bool render_strokes = false;
+    float scale = 1.0f;
+
+    // Outputs to produce. Outputs that are not requested are neither computed nor encoded
+    bool write_texture = true;
+    bool write_paint = true;
+    bool write_height = true;
+    // Output image format: png, png-fast (lowest zlib compression) or pnm (uncompressed PPM/PGM)
+    std::string format = "png";
+
+    // Threads used by the parallel image operations (0 for one per hardware thread), and whether they are pinned to cores
+    int num_threads = 0;
+    bool pin_threads = false;
+
+    // Approximate the lights as distant lights and shade with a normal-indexed lookup table
+    bool distant_lights = false;
+
+    // Instruction set variant of the image kernels (auto for the best the CPU supports)
+    std::string kernels = "auto";
+    // Benchmark the kernel variants instead of painting
+    bool benchmark_kernels = false;
+};
+
+/**
+ * Input of a single image, decoded ahead of painting
+*/
+struct DecodedInput {
+    std::string input_file;
+    cv::Mat input_image;
+    // Only loaded when rendering stroke lists
+    StrokeList *stroke_list = nullptr;
+};
+
+/**
+ * Output image waiting to be encoded and written
+*/
+struct EncodeJob {
+    std::string path;
+    // Owned by the job
+    cv::Mat *image = nullptr;
+    // Printed once the image is written (e.g. "Texture image")
+    std::string description;
+    // Output the image belongs to (e.g. "texture"). Write times are reported per writer
+    std::string writer;
+};
+
+/**
+ * Time spent writing the images of a single writer
+*/
+struct WriterStats {
+    int num_images = 0;
+    double total_ms = 0.0;
+};
+
+// Number of threads decoding inputs ahead of painting and encoding outputs behind it
+const int num_decoders = 2;
+const int num_encoders = 3;
+// Number of decoded inputs and pending outputs that can wait between the stages
+const int decode_queue_size = 2;
+const int encode_queue_size = 8;
+
+// Names of the stroke placements
+const std::map<std::string, StrokePlacement> stroke_placements = {
+    {"grid", StrokePlacement::GRID},
+    {"quadtree", StrokePlacement::QUADTREE}
+};
+
+// Names of the stroke orders
+const std::map<std::string, StrokeOrder> stroke_orders = {
+    {"raster", StrokeOrder::RASTER},
+    {"random", StrokeOrder::RANDOM},
+    {"morton", StrokeOrder::MORTON},
+    {"hilbert", StrokeOrder::HILBERT}
+};
+
+/**
+ * Parses a comma separated list of floats (e.g. "1,2.5,3").
+ *
+ * @param str: String to parse
+ *
+ * @return: Parsed values. Empty if the string is not a valid list
+*/
+std::vector<float> parse_floats(const std::string &str) {
+    std::vector<float> values;
+    std::stringstream stream(str);
+    std::string token;
+
+    while (std::getline(stream, token, ',')) {
+        try {
+            values.push_back(std::stof(token));
+        } catch (const std::exception &) {
+            return std::vector<float>();
+        }
+    }
+    return values;
+}
+
+/**
+ * Parses a comma separated list of strings (e.g. "a.png,b.png"). Empty entries are skipped.
+ *
+ * @param str: String to parse
+ *
+ * @return: Parsed values
+*/
+std::vector<std::string> parse_strings(const std::string &str) {
+    std::vector<std::string> values;
+    std::stringstream stream(str);
+    std::string token;
+
+    while (std::getline(stream, token, ',')) {
+        if (!token.empty()) {
+            values.push_back(token);
+        }
+    }
+    return values;
+}
+
+/**
+ * @param directory: Path of a directory, with or without a trailing separator
+ *
+ * @return: The path with a trailing separator
+*/
+std::string get_directory(const std::string &directory) {
+    if (directory.empty() || directory.back() == '/') {
+        return directory;
+    }
+    return directory + "/";
+}
+
+/**
+ * Parses the command line.
+ *
+ * @param argc: Number of arguments
+ * @param argv: Arguments
+ * @param options: Output for the parsed options
+ *
+ * @return: True if the command line is valid. Otherwise the problem has been printed
+*/
+bool parse_arguments(int argc, const char **argv, Options &options) {
+    // Standalone benchmark
+    if (argc == 2 && std::string(argv[1]) == "--benchmark-kernels") {
+        options.benchmark_kernels = true;
+        return true;
+    }
+
     // No arguments provided
     if (argc < 3) {
-        std::cout << "Usage: fast-paint-texture (input file) (shader)\n" << std::endl;
-        return 1;
-    } 
-    // Input file and shader provided 
-    else if (argc == 3) {
-        input_file = argv[1];
-        input_shader = argv[2];
+        std::cout << "Usage: fast-paint-texture (input file)[,(input file)...] (shader) [--light x,y,z[,r,g,b[,range]]]... [--view x,y,z] " <<
+            "[--progressive] [--progressive-strokes n] [--time-budget ms] [--stroke-budget n] " <<
+            "[--placement grid|quadtree] [--importance edges|(mask file)] [--importance-strength k] " <<
+            "[--stroke-order raster|random|morton|hilbert] [--benchmark-stroke-order] " <<
+            "[--export-strokes] [--render-strokes] [--scale s] [--outputs texture,paint,height] [--format png|png-fast|pnm] " <<
+            "[--threads n] [--pin] [--distant-lights] [--kernels auto|baseline|sse4.2|avx2|avx512] " <<
+            "[--input-dir dir] [--brush-dir dir] [--output-dir dir] [--cache-dir dir] [--cache-size mb] [--no-cache]\n" << 
+            "       fast-paint-texture --benchmark-kernels\n" << std::endl;
+        return false;
+    }
+
+    // Input files and shader provided
+    options.input_files = parse_strings(argv[1]);
+    options.input_shader = argv[2];
+
+    if (options.input_files.empty()) {
+        std::cout << "Invalid input file: " << argv[1] << "\n" << std::endl;
+        return false;
+    }
+
+    // Optional arguments
+    for (int i = 3; i < argc; i++) {
+        std::string option = argv[i];
+
+        if (option == "--light" && i + 1 < argc) {
+            std::vector<float> values = parse_floats(argv[++i]);
+            if ((values.size() != 3 && values.size() != 6 && values.size() != 7) || (values.size() == 7 && values[6] < 0.0f)) {
+                std::cout << "Invalid light: " << argv[i] << ". Expected x,y,z or x,y,z,r,g,b or x,y,z,r,g,b,range\n" << std::endl;
+                return false;
+            }
+            Vector3f intensity = values.size() >= 6 ? Vector3f(values[3], values[4], values[5]) : Vector3f(1.0f, 1.0f, 1.0f);
+            float range = values.size() == 7 ? values[6] : 0.0f;
+            options.lights.push_back(Light(Vector3f(values[0], values[1], values[2]), intensity, range));
+        }
+        else if (option == "--view" && i + 1 < argc) {
+            std::vector<float> values = parse_floats(argv[++i]);
+            if (values.size() != 3) {
+                std::cout << "Invalid view position: " << argv[i] << ". Expected x,y,z\n" << std::endl;
+                return false;
+            }
+            options.view_pos = Vector3f(values[0], values[1], values[2]);
+            options.view_provided = true;
+        }
+        else if (option == "--progressive") {
+            options.progressive = true;
+        }
+        else if (option == "--progressive-strokes" && i + 1 < argc) {
+            options.progressive = true;
+            options.preview_strokes = std::atoi(argv[++i]);
+            if (options.preview_strokes <= 0) {
+                std::cout << "Invalid number of strokes between previews: " << argv[i] << "\n" << std::endl;
+                return false;
+            }
+        }
+        else if (option == "--time-budget" && i + 1 < argc) {
+            options.budget.time_ms = std::atof(argv[++i]);
+            if (options.budget.time_ms <= 0.0) {
+                std::cout << "Invalid time budget: " << argv[i] << "\n" << std::endl;
+                return false;
+            }
+        }
+        else if (option == "--stroke-budget" && i + 1 < argc) {
+            options.budget.strokes = std::atoi(argv[++i]);
+            if (options.budget.strokes <= 0) {
+                std::cout << "Invalid stroke budget: " << argv[i] << "\n" << std::endl;
+                return false;
+            }
+        }
+        else if (option == "--placement" && i + 1 < argc) {
+            std::string placement = argv[++i];
+            if (stroke_placements.find(placement) == stroke_placements.end()) {
+                std::cout << "Invalid stroke placement: " << placement << ". Pick from grid and quadtree\n" << std::endl;
+                return false;
+            }
+            options.stroke_placement = stroke_placements.at(placement);
+        }
+        else if (option == "--importance" && i + 1 < argc) {
+            std::string importance = argv[++i];
+            if (importance == "edges") {
+                options.importance.source = ImportanceSource::EDGES;
+            }
+            else {
+                options.importance.source = ImportanceSource::MASK;
+                options.importance_mask_path = importance;
+            }
+        }
+        else if (option == "--importance-strength" && i + 1 < argc) {
+            options.importance.strength = std::atof(argv[++i]);
+            if (options.importance.strength < 0.0f) {
+                std::cout << "Invalid importance strength: " << argv[i] << "\n" << std::endl;
+                return false;
+            }
+        }
+        else if (option == "--stroke-order" && i + 1 < argc) {
+            std::string order = argv[++i];
+            if (stroke_orders.find(order) == stroke_orders.end()) {
+                std::cout << "Invalid stroke order: " << order << ". Pick from raster, random, morton and hilbert\n" << std::endl;
+                return false;
+            }
+            options.stroke_order = stroke_orders.at(order);
+        }
+        else if (option == "--benchmark-stroke-order") {
+            options.benchmark_stroke_order = true;
+        }
+        else if (option == "--export-strokes") {
+            options.export_strokes = true;
+        }
+        else if (option == "--render-strokes") {
+            options.render_strokes = true;
+        }
+        else if (option == "--scale" && i + 1 < argc) {
+            options.scale = std::atof(argv[++i]);
+            if (options.scale <= 0.0f) {
+                std::cout << "Invalid scale: " << argv[i] << "\n" << std::endl;
+                return false;
+            }
+        }
+        else if (option == "--outputs" && i + 1 < argc) {
+            options.write_texture = options.write_paint = options.write_height = false;
+            for (const std::string &output : parse_strings(argv[++i])) {
+                if (output == "texture") {
+                    options.write_texture = true;
+                }
+                else if (output == "paint") {
+                    options.write_paint = true;
+                }
+                else if (output == "height") {
+                    options.write_height = true;
+                }
+                else {
+                    std::cout << "Invalid output: " << output << ". Pick from texture, paint and height\n" << std::endl;
+                    return false;
+                }
+            }
+            if (!options.write_texture && !options.write_paint && !options.write_height) {
+                std::cout << "No outputs selected\n" << std::endl;
+                return false;
+            }
+        }
+        else if (option == "--format" && i + 1 < argc) {
+            options.format = argv[++i];
+            if (options.format != "png" && options.format != "png-fast" && options.format != "pnm") {
+                std::cout << "Invalid format: " << options.format << ". Pick from png, png-fast and pnm\n" << std::endl;
+                return false;
+            }
+        }
+        else if (option == "--threads" && i + 1 < argc) {
+            options.num_threads = std::atoi(argv[++i]);
+            if (options.num_threads <= 0) {
+                std::cout << "Invalid number of threads: " << argv[i] << "\n" << std::endl;
+                return false;
+            }
+        }
+        else if (option == "--pin") {
+            options.pin_threads = true;
+        }
+        else if (option == "--distant-lights") {
+            options.distant_lights = true;
+        }
+        else if (option == "--kernels" && i + 1 < argc) {
+            options.kernels = argv[++i];
+        }
+        else if (option == "--input-dir" && i + 1 < argc) {
+            options.input_path = get_directory(argv[++i]);
+        }
+        else if (option == "--brush-dir" && i + 1 < argc) {
+            options.stroke_texture_path = get_directory(argv[++i]);
+        }
+        else if (option == "--output-dir" && i + 1 < argc) {
+            // Every output directory lives under the output directory
+            std::string output_path = get_directory(argv[++i]);
+            options.texture_path = output_path + "texture/";
+            options.paint_path = output_path + "paint/";
+            options.height_path = output_path + "height/";
+            options.cache_path = output_path + "cache/";
+            options.stroke_path = output_path + "strokes/";
+        }
+        else if (option == "--cache-dir" && i + 1 < argc) {
+            options.cache_path = get_directory(argv[++i]);
+        }
+        else if (option == "--cache-size" && i + 1 < argc) {
+            options.cache_size_mb = std::atof(argv[++i]);
+            if (options.cache_size_mb <= 0.0) {
+                std::cout << "Invalid cache size: " << argv[i] << "\n" << std::endl;
+                return false;
+            }
+        }
+        else if (option == "--no-cache") {
+            options.use_cache = false;
+        }
+        else {
+            std::cout << "Invalid argument: " << option << "\n" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @param options: Command line options
+ * @param file: Output file name (e.g. "paint-image.png")
+ * @param colour: True for colour images, false for gray-scale images
+ *
+ * @return: The file name with the extension of the output format
+*/
+std::string get_output_file(const Options &options, const std::string &file, const bool colour) {
+    if (options.format != "pnm") {
+        return file;
+    }
+    return file.substr(0, file.find_last_of('.')) + (colour ? ".ppm" : ".pgm");
+}
+
+/**
+ * @param options: Command line options
+ *
+ * @return: OpenCV encoder parameters of the output format
+*/
+std::vector<int> get_write_params(const Options &options) {
+    if (options.format == "png-fast") {
+        return {cv::IMWRITE_PNG_COMPRESSION, 1};
+    }
+    if (options.format == "pnm") {
+        return {cv::IMWRITE_PXM_BINARY, 1};
+    }
+    return {};
+}
+
+/**
+ * Creates the lighting shader with the given name.
+ *
+ * @param input_shader: Name of the shader
+ *
+ * @return: The shader, or nullptr if the name is invalid
+*/
+std::unique_ptr<Shader> create_shader(const std::string &input_shader) {
+    const std::map<std::string, std::string> shader_names = {
+        {"blinn-phong", "Blinn-Phong"},
+        {"lambertian", "Lambertian"},
+        {"oren-nayar", "Oren-Nayar"},
+        {"toon", "Toon (Cel Shading)"},
+        {"normal", "Normal"}
+    };
+
+    std::unique_ptr<Shader> shader = FastPaintAPI::create_shader(input_shader);
+    if (shader != nullptr) {
+        std::cout << "Rendering using " << shader_names.at(input_shader) << " lighting shader" << std::endl;
+    }
+    return shader;
+}
+
+/**
+ * @param input_file: Name of the input image
+ *
+ * @return: Name of the stroke list of the input image
+*/
+std::string get_stroke_file(const std::string &input_file) {
+    return input_file.substr(0, input_file.find_last_of('.')) + ".fpts";
+}
+
+/**
+ * Decodes the input of a single image: the input image, or its stroke list when rendering strokes.
+ *
+ * @param options: Command line options
+ * @param input_file: Name of the input image
+ * @param input: Output for the decoded input
+ *
+ * @return: True if the input was decoded successfully. Otherwise the problem has been printed
+*/
+bool decode_input(const Options &options, const std::string &input_file, DecodedInput &input) {
+    input.input_file = input_file;
+
+    if (options.render_strokes) {
+        // Load the strokes of a previous painting instead of the input image
+        std::string stroke_file = get_stroke_file(input_file);
+        input.stroke_list = StrokeList::load(options.stroke_path + stroke_file);
+        if (input.stroke_list == nullptr) {
+            std::cerr << "Error: Could not open the stroke list " << options.stroke_path + stroke_file << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // Load input image with colour
+    input.input_image = cv::imread(options.input_path + input_file, cv::IMREAD_COLOR);
+    if (input.input_image.empty()) {
+        std::cerr << "Error: Could not open the input image " << options.input_path + input_file << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Paints (or renders the strokes of) a single decoded input and queues its outputs for encoding.
+ *
+ * @param options: Command line options
+ * @param shader: Lighting shader
+ * @param brushes: Height and opacity textures for the brush strokes
+ * @param cache: Cache of intermediates and results (nullptr if caching is disabled)
+ * @param input: Decoded input. Its stroke list is freed
+ * @param encode_queue: Queue of outputs to encode
+*/
+void process_input(const Options &options, Shader *shader, const std::shared_ptr<const BrushTextures> &brushes, Cache *cache,
+                   DecodedInput &input, BoundedQueue<EncodeJob> &encode_queue) {
+    std::string input_file = input.input_file;
+    // Name of the texture file (final output), paint file (output), height file (output), and stroke list
+    std::string paint_file = "paint-" + input_file;
+    std::string texture_file = options.input_shader + "-" + input_file;
+    std::string height_file = "height-" + input_file;
+    std::string stroke_file = get_stroke_file(input_file);
+
+    StrokeList *stroke_list = input.stroke_list;
+    int width, height;
+
+    if (options.render_strokes) {
+        width = std::max((int) std::lround(stroke_list->get_width() * options.scale), 1);
+        height = std::max((int) std::lround(stroke_list->get_height() * options.scale), 1);
+
+        cout << "Loaded: " << stroke_file << " (" << stroke_list->get_num_strokes() << " strokes, " <<
+            stroke_list->get_width() << "x" << stroke_list->get_height() << ")" << std::endl;
     }
-    // More than one arguments provided
     else {
-        std::cout << "Too many arguments provided\n" << std::endl;
-        return 1;
+        width = input.input_image.cols;
+        height = input.input_image.rows;
+
+        cout << "Loaded: " << input_file <<  " (" << width << "x" << height << ")" << ::endl;
     }
 
-    std::unique_ptr<Shader> shader;
-
-    // Select lighting shader based on input 
-    if (input_shader == "blinn-phong") {
-        std::cout << "Rendering using Blinn-Phong lighting shader" << std::endl;
-        shader = std::make_unique<BlinnPhongShader>();
-    } 
-    else if (input_shader == "lambertian") {
-        std::cout << "Rendering using Lambertian lighting shader" << std::endl;
-        shader = std::make_unique<LambertianShader>();
-    } 
-    else if (input_shader == "oren-nayar") {
-        std::cout << "Rendering using Oren-Nayar lighting shader" << std::endl;
-        shader = std::make_unique<OrenNayarShader>();
-    } 
-    else if (input_shader == "toon") {
-        std::cout << "Rendering using Toon (Cel Shading) lighting shader" << std::endl;
-        shader = std::make_unique<ToonShader>();
-    } 
-    else if (input_shader == "normal") {
-        std::cout << "Rendering using Normal lighting shader" << std::endl;
-        shader = std::make_unique<NormalShader>();
-    } 
+    // Create a fast-paint-texture instance for the input image (or a render-only instance for the stroke list)
+    FastPaintTexture *paint;
+    if (options.render_strokes) {
+        paint = new FastPaintTexture(width, height, brushes);
+    }
     else {
-        std::cout << "Invalid shader. Pick from:\n\tblinn-phong\n\tlambertian\n\toren-nayar\n\ttoon\n\tnormal" << std::endl;
+        paint = new FastPaintTexture(width, height, input.input_image, brushes);
+    }
+
+    paint->set_budget(options.budget);
+    paint->set_distant_lights(options.distant_lights);
+    paint->set_stroke_placement(options.stroke_placement);
+    paint->set_stroke_order(options.stroke_order);
+    paint->set_cache(cache);
+
+    // The importance mask is resized to the input image
+    Importance importance = options.importance;
+    if (!options.render_strokes) {
+        if (importance.source == ImportanceSource::MASK) {
+            importance.mask = Importance::create_mask(options.importance_mask, width, height);
+        }
+        paint->set_importance(importance);
+    }
+
+    // Budgeted paintings are incomplete and progressive output needs the painting process, so neither 
+    // is looked up in or added to the cache (only the blurred reference images are)
+    bool cache_painting = cache != nullptr && !options.render_strokes && !options.budget.is_limited() && !options.progressive;
+
+    // Record the strokes of the painting
+    if ((options.export_strokes || cache_painting) && !options.render_strokes) {
+        stroke_list = new StrokeList(width, height, Vector3f::Zero());
+        paint->set_stroke_list(stroke_list);
+    }
+
+    // Save every preview as part of a numbered file sequence
+    if (options.progressive) {
+        std::string preview_path = options.texture_path + "progress-";
+        std::string preview_file = get_output_file(options, texture_file, true);
+        paint->set_preview_callback([&encode_queue, preview_path, preview_file](int sequence, int layer, RGBImage *preview) {
+            std::string path = preview_path + std::to_string(sequence) + "-" + preview_file;
+            encode_queue.push({path, preview->to_cv_mat(), "Preview of layer " + std::to_string(layer), "preview"});
+        }, options.preview_strokes);
+    }
+
+    // Only texture the painting if the textured image is needed
+    Shader *texture_shader = options.write_texture || options.progressive ? shader : nullptr;
+
+    std::vector<Light> lights = options.lights.empty() ? paint->get_default_lights() : options.lights;
+    Vector3f view_pos = options.view_provided ? options.view_pos : paint->get_default_view_pos();
+
+    RGBImage *texture_image = nullptr, *paint_image = nullptr;
+    GrayImage *height_map = nullptr;
+
+    if (options.render_strokes) {
+        // Rasterize the stroke list with the current brush stroke textures
+        std::cout << "Rendering " << stroke_list->get_num_strokes() << " strokes at " << width << "x" << height << std::endl;
+        std::tie<RGBImage*, GrayImage*>(paint_image, height_map) = paint->render(stroke_list);
+        if (options.write_texture) {
+            texture_image = paint->texture(paint_image, height_map, shader, view_pos, lights);
+        }
+    }
+    else {
+        // The strokes only depend on the input image and painting parameters. The G-buffer also 
+        // depends on the brush stroke textures, and the textured image on the lighting
+        std::string stroke_key = CacheKey::strokes(input.input_image, options.stroke_order, importance) + ".fpts";
+        std::string painting_key = CacheKey::painting(input.input_image, brushes->get_height_texture(), brushes->get_opacity_texture(),
+            options.stroke_order, importance);
+        std::string gbuffer_key = painting_key + ".gbuf";
+        std::string texture_key = CacheKey::texture(painting_key, options.input_shader, view_pos, lights, options.distant_lights) + ".tex";
+
+        if (cache_painting) {
+            if (cache->lookup(gbuffer_key)) {
+                std::tie<RGBImage*, GrayImage*>(paint_image, height_map) = GBuffer::load(cache->get_path(gbuffer_key), width, height);
+            }
+
+            // Strokes are cached too if the painting is, so they can be exported without painting again
+            StrokeList *cached_strokes = cache->lookup(stroke_key) ? StrokeList::load(cache->get_path(stroke_key)) : nullptr;
+            if (cached_strokes != nullptr && (cached_strokes->get_width() != width || cached_strokes->get_height() != height)) {
+                delete cached_strokes;
+                cached_strokes = nullptr;
+            }
+
+            // Painted with other brush stroke textures: render the cached strokes instead of tracing them again
+            if (paint_image == nullptr && cached_strokes != nullptr) {
+                std::cout << "Rendering cached strokes: " << cache->get_path(stroke_key) << std::endl;
+                std::tie<RGBImage*, GrayImage*>(paint_image, height_map) = paint->render(cached_strokes);
+
+                std::string write_path = cache->get_write_path(gbuffer_key);
+                cache->commit(gbuffer_key, write_path, GBuffer::save(write_path, paint_image, height_map));
+            }
+            else if (paint_image != nullptr) {
+                std::cout << "Using cached G-buffer: " << cache->get_path(gbuffer_key) << std::endl;
+            }
+
+            if (paint_image != nullptr && options.export_strokes) {
+                if (cached_strokes != nullptr && cached_strokes->save(options.stroke_path + stroke_file)) {
+                    cout << "Stroke list (" << cached_strokes->get_num_strokes() << " strokes) saved to: " << options.stroke_path + stroke_file << std::endl;
+                }
+                else {
+                    // The strokes have been evicted, so the image is painted again to record them
+                    std::cout << "No cached strokes found. Painting the image again to export them" << std::endl;
+                    delete paint_image;
+                    delete height_map;
+                    paint_image = nullptr;
+                    height_map = nullptr;
+                }
+            }
+            delete cached_strokes;
+
+            // Relight the cached painting, unless the textured image is cached as well
+            if (paint_image != nullptr && options.write_texture) {
+                if (cache->lookup(texture_key)) {
+                    texture_image = cache->load_image(texture_key, width, height);
+                }
+                if (texture_image != nullptr) {
+                    std::cout << "Using cached texture image: " << cache->get_path(texture_key) << std::endl;
+                }
+                else {
+                    texture_image = paint->texture(paint_image, height_map, shader, view_pos, lights);
+                    cache->save_image(texture_key, texture_image);
+                }
+            }
+        }
+
+        // Apply the fast-paint-texture to the input image
+        if (paint_image == nullptr) {
+            std::tie<RGBImage*, RGBImage*, GrayImage*>(texture_image, paint_image, height_map) = paint->fast_paint_texture(texture_shader, view_pos, lights);
+            std::cout << "Suppressed " << paint->get_duplicate_strokes() << " duplicate strokes" << std::endl;
+            if (importance.is_enabled()) {
+                std::cout << "Skipped " << paint->get_unimportant_strokes() << " unimportant strokes" << std::endl;
+            }
+
+            // Cache the painting so it can be relit, or rendered with other brush stroke textures, later
+            if (cache_painting) {
+                std::string write_path = cache->get_write_path(gbuffer_key);
+                bool cached = cache->commit(gbuffer_key, write_path, GBuffer::save(write_path, paint_image, height_map));
+
+                write_path = cache->get_write_path(stroke_key);
+                cached = cache->commit(stroke_key, write_path, stroke_list->save(write_path)) && cached;
+
+                if (texture_image != nullptr) {
+                    cached = cache->save_image(texture_key, texture_image) && cached;
+                }
+                if (cached) {
+                    cout << "Painting cached with key: " << painting_key << std::endl;
+                }
+                else {
+                    std::cerr << "Warning: Could not cache the painting in " << options.cache_path << std::endl;
+                }
+            }
+            else if (cache != nullptr && options.budget.is_limited()) {
+                std::cout << "Budgeted painting: not cached" << std::endl;
+            }
+
+            // Save the strokes so the painting can be rendered again without tracing
+            if (options.export_strokes) {
+                if (stroke_list->save(options.stroke_path + stroke_file)) {
+                    cout << "Stroke list (" << stroke_list->get_num_strokes() << " strokes) saved to: " << options.stroke_path + stroke_file << std::endl;
+                }
+                else {
+                    std::cerr << "Warning: Could not save the stroke list to " << options.stroke_path + stroke_file << std::endl;
+                }
+            }
+        }
+    }
+
+    // Queue the requested outputs (shaded image, painted image and height map). They are encoded while the next image is painted
+    if (options.write_texture) {
+        encode_queue.push({options.texture_path + get_output_file(options, texture_file, true), texture_image->to_cv_mat(), "Texture image", "texture"});
+    }
+    if (options.write_paint) {
+        encode_queue.push({options.paint_path + get_output_file(options, paint_file, true), paint_image->to_cv_mat(), "Image", "paint"});
+    }
+    if (options.write_height) {
+        encode_queue.push({options.height_path + get_output_file(options, height_file, false), height_map->to_cv_mat(), "Height map", "height"});
+    }
+
+    // Free memory
+    delete texture_image;
+    delete paint_image;
+    delete height_map;
+
+    delete paint;
+    delete stroke_list;
+    input.stroke_list = nullptr;
+}
+
+int main(int argc, const char **argv) {
+    Options options;
+    if (!parse_arguments(argc, argv, options)) {
         return 1;
     }
 
-    paint_file = "paint-" + input_file;
-    texture_file = input_shader + "-" + input_file;
-    height_file = "height-" + input_file;
+    if (options.benchmark_kernels) {
+        return Simd::benchmark() ? 0 : 1;
+    }
 
-    // Load input image with colour
-    cv::Mat input_image =  cv::imread(input_path + input_file, cv::IMREAD_COLOR);
-    if (input_image.empty()) {
-        std::cerr << "Error: Could not open the input image" << std::endl;
-        return -1;
+    try {
+        Simd::select(options.kernels);
+    } catch (const std::invalid_argument &error) {
+        std::cout << error.what() << std::endl;
+        return 1;
     }
+    std::cout << "Using " << Simd::get().name << " kernels" << std::endl;
 
-    cout << "Loaded: " << input_file <<  " (" << input_image.cols << "x" << input_image.rows << ")" << ::endl;
+    Parallel::configure(options.num_threads, options.pin_threads);
 
-    // Load brush stroke textures
-    cv::Mat height_texture_image = cv::imread(stroke_texture_path + "height.png", cv::IMREAD_GRAYSCALE);
-    if (height_texture_image.empty()) {
-        std::cerr << "Error: Could not open the height texture" << std::endl;
-        return -1;
+    std::unique_ptr<Shader> shader = create_shader(options.input_shader);
+    if (shader == nullptr) {
+        std::cout << "Invalid shader. Pick from:\n\tblinn-phong\n\tlambertian\n\toren-nayar\n\ttoon\n\tnormal" << std::endl;
+        return 1;
     }
-    Texture *height_texture = new Texture(height_texture_image.cols, height_texture_image.rows, height_texture_image);
 
-    cv::Mat opacity_texture_image = cv::imread(stroke_texture_path + "opacity.png", cv::IMREAD_GRAYSCALE);
-    if (opacity_texture_image.empty()) {
-        std::cerr << "Error: Could not open the opacity texture" << std::endl;
+    // Load brush stroke textures. Every painting shares them
+    std::shared_ptr<const BrushTextures> brushes;
+    try {
+        brushes = BrushTextures::load(options.stroke_texture_path);
+    } catch (const std::invalid_argument &error) {
+        std::cerr << "Error: " << error.what() << std::endl;
         return -1;
     }
-    Texture *opacity_texture = new Texture(opacity_texture_image.cols, opacity_texture_image.rows, opacity_texture_image);
+
+    // Load the importance mask. Every painting resizes it to its input image
+    if (options.importance.source == ImportanceSource::MASK) {
+        options.importance_mask = cv::imread(options.importance_mask_path, cv::IMREAD_GRAYSCALE);
+        if (options.importance_mask.empty()) {
+            std::cerr << "Error: Could not open the importance mask " << options.importance_mask_path << std::endl;
+            return -1;
+        }
+    }
+
+    // Compare the stroke orders on the first input image
+    if (options.benchmark_stroke_order) {
+        cv::Mat input_image = cv::imread(options.input_path + options.input_files[0], cv::IMREAD_COLOR);
+        if (input_image.empty()) {
+            std::cerr << "Error: Could not open the input image " << options.input_path + options.input_files[0] << std::endl;
+            return 1;
+        }
+        Benchmark::stroke_orders(input_image, brushes);
+        return 0;
+    }
+
+    // Intermediates and results are cached across runs
+    std::unique_ptr<Cache> cache;
+    if (options.use_cache) {
+        cache = std::make_unique<Cache>(options.cache_path, (uintmax_t) (options.cache_size_mb * 1024 * 1024));
+    }
 
     #ifdef ANIMATE
         std::cout << "Running in animation mode" << std::endl;
     #endif
 
-    // Create a fast-paint-texture instance for the input image
-    FastPaintTexture paint(input_image.cols, input_image.rows, input_image, height_texture, opacity_texture);
+    // Inputs are decoded ahead of painting and outputs are encoded behind it. The bounded queues
+    // stop decoding from running too far ahead and painting from outrunning the encoders
+    BoundedQueue<DecodedInput> decode_queue(decode_queue_size);
+    BoundedQueue<EncodeJob> encode_queue(encode_queue_size);
 
-    // Apply the fast-paint-texture to the input image
-    RGBImage *texture_image, *paint_image;
-    GrayImage *height_map;
-    std::tie<RGBImage*, RGBImage*, GrayImage*>(texture_image, paint_image, height_map) = paint.fast_paint_texture(shader.get());
+    std::atomic<int> next_input(0);
+    std::atomic<bool> failed(false);
 
-    // Save the shaded image
-    cv::Mat *cv_texture_image = texture_image->to_cv_mat();
-    cv::imwrite(texture_path + texture_file, *cv_texture_image);
-    cout << "Texture image saved to: " << texture_path + texture_file << std::endl;
+    std::vector<int> write_params = get_write_params(options);
+    std::map<std::string, WriterStats> writer_stats;
+    std::mutex writer_stats_mutex;
 
-    // Save the painted image
-    cv::Mat *cv_paint_image = paint_image->to_cv_mat();
-    cv::imwrite(paint_path + paint_file, *cv_paint_image);
-    cout << "Image saved to: " << paint_path + paint_file << std::endl;
+    WorkerGroup encoders(num_encoders, [&]() {
+        EncodeJob job;
+        while (encode_queue.pop(job)) {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            bool written = cv::imwrite(job.path, *job.image, write_params);
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
 
-    // Save the height map
-    cv::Mat *cv_height_map = height_map->to_cv_mat();
-    cv::imwrite(height_path + height_file, *cv_height_map);
-    cout << "Height map saved to: " << height_path + height_file << std::endl;
+            {
+                std::lock_guard<std::mutex> lock(writer_stats_mutex);
+                writer_stats[job.writer].num_images++;
+                writer_stats[job.writer].total_ms += elapsed.count();
+            }
 
-    // Free memory
-    delete texture_image;
-    delete cv_texture_image;
+            if (written) {
+                cout << job.description + " saved to: " + job.path + "\n";
+            }
+            else {
+                std::cerr << "Error: Could not write " + job.path + "\n";
+                failed = true;
+            }
+            delete job.image;
+        }
+    });
 
-    delete paint_image;
-    delete cv_paint_image;
-    
-    delete height_map;
-    delete cv_height_map;
+    // Decoders may finish out of order, so each input waits for its turn and inputs are painted in 
+    // command-line order. The last decoder to finish closes the queue
+    int next_turn = 0;
+    std::mutex turn_mutex;
+    std::condition_variable turn_changed;
+    std::atomic<int> running_decoders(std::min(num_decoders, (int) options.input_files.size()));
+    WorkerGroup decoders(running_decoders, [&]() {
+        for (int i = next_input++; i < (int) options.input_files.size(); i = next_input++) {
+            DecodedInput input;
+            bool decoded = decode_input(options, options.input_files[i], input);
+            {
+                std::unique_lock<std::mutex> lock(turn_mutex);
+                turn_changed.wait(lock, [&]() { return next_turn == i; });
+            }
 
-    if (height_texture != nullptr) delete height_texture;
-    if (opacity_texture != nullptr) delete opacity_texture;
+            // The queue is only closed early if painting failed
+            if (!decoded) {
+                failed = true;
+            }
+            else if (!decode_queue.push(input)) {
+                delete input.stroke_list;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(turn_mutex);
+                next_turn++;
+            }
+            turn_changed.notify_all();
+        }
+        if (--running_decoders == 0) {
+            decode_queue.close();
+        }
+    });
+
+    // Paint on the main thread. If a painting throws, both queues are closed so that the decoders 
+    // and encoders return instead of waiting for the main thread
+    DecodedInput input;
+    try {
+        while (decode_queue.pop(input)) {
+            process_input(options, shader.get(), brushes, cache.get(), input, encode_queue);
+        }
+    } catch (const std::exception &error) {
+        std::cerr << "Error: Could not paint " << input.input_file << ": " << error.what() << std::endl;
+        decode_queue.close();
+        failed = true;
+
+        // Free the inputs that will not be painted
+        DecodedInput skipped;
+        while (decode_queue.pop(skipped)) {
+            delete skipped.stroke_list;
+        }
+    }
+
+    decoders.join();
+    encode_queue.close();
+    encoders.join();
+
+    // Time spent encoding and writing each output
+    for (const std::pair<const std::string, WriterStats> &stats : writer_stats) {
+        std::cout << "Writer " << stats.first << " (" << options.format << "): " << stats.second.num_images << " images in " <<
+            stats.second.total_ms << " ms (" << stats.second.total_ms / stats.second.num_images << " ms per image)" << std::endl;
+    }
 
-    return 0;
-}
\ No newline at end of file
+    return failed ? -1 : 0;
+}
@@ -1,3 +1,6 @@
+#include <algorithm>
+#include <map>
+#include <numeric>
 #include <opencv2/opencv.hpp>
 
 #include "paint.hpp"
@@ -6,10 +9,12 @@
 #include "kernel.hpp"
 #include "stroke.hpp"
 #include "parameters.hpp"
+#include "parallel.hpp"
+#include "simd.hpp"
 
 using namespace std;
 
-FastPaintTexture::FastPaintTexture(int width, int height, cv::Mat source_image, Texture *height_texture, Texture *opacity_texture) {
+FastPaintTexture::FastPaintTexture(int width, int height, cv::Mat source_image, std::shared_ptr<const BrushTextures> brushes) {
     // Ensure dimensions are valid
     if (source_image.cols != width || source_image.rows != height) {
         throw std::invalid_argument("Unable to create rasterizer: input image dimensions \
@@ -20,76 +25,244 @@ FastPaintTexture::FastPaintTexture(int width, int height, cv::Mat source_image,
     this->height = height;
     this->source_image = new RGBImage(width, height, source_image);
 
-    this->counters = new int[width * height];
-    this->total_mask = new float[width * height];
-    this->old_colours = new Vector3f[width * height];
+    this->brushes = brushes;
+    this->sampler = brushes->get_sampler();
+}
+
+FastPaintTexture::FastPaintTexture(RGBImage *source_image, std::shared_ptr<const BrushTextures> brushes) {
+    this->width = source_image->get_width();
+    this->height = source_image->get_height();
+    this->source_image = source_image;
 
-    this->height_texture = height_texture;
-    this->opacity_texture = opacity_texture;
+    this->brushes = brushes;
+    this->sampler = brushes->get_sampler();
 }
 
-std::tuple<RGBImage*, RGBImage*, GrayImage*> FastPaintTexture::fast_paint_texture(Shader *shader) {
-    RGBImage *paint_image, *texture_image; 
-    GrayImage *height_map;
+FastPaintTexture::FastPaintTexture(int width, int height, std::shared_ptr<const BrushTextures> brushes) {
+    // Ensure dimensions are valid
+    if (width <= 0 || height <= 0) {
+        throw std::invalid_argument("Unable to create rasterizer: invalid width or height.");
+    }
 
+    this->width = width;
+    this->height = height;
+    this->source_image = nullptr;
+
+    this->brushes = brushes;
+    this->sampler = brushes->get_sampler();
+}
+
+void FastPaintTexture::set_importance(const Importance &importance) {
+    if (importance.strength < 0.0f) {
+        throw std::invalid_argument("Invalid importance: the strength must not be negative.");
+    }
+    if (importance.source == ImportanceSource::MASK && (importance.mask == nullptr || 
+        importance.mask->get_width() != this->width || importance.mask->get_height() != this->height)) {
+        throw std::invalid_argument("Invalid importance: the mask does not match the image dimensions.");
+    }
+    this->importance = importance;
+}
+
+std::vector<Light> FastPaintTexture::get_default_lights() const {
     Light light1 = Light(Vector3f(this->width / 4, this->height / 4, 500), Vector3f(1.0f, 1.0f, 1.0f));
     Light light2 = Light(Vector3f(this->width / 4, 3 * this->height / 4, 500), Vector3f(1.0f, 1.0f, 1.0f));
     Light light3 = Light(Vector3f(3 * this->width / 4, this->height / 4, 500), Vector3f(1.0f, 1.0f, 1.0f));
     Light light4 = Light(Vector3f(3 * this->width / 4, 3 * this->height / 4, 500), Vector3f(1.0f, 1.0f, 1.0f));
-    std::vector<Light> lights = {light1, light2, light3, light4};
+    return {light1, light2, light3, light4};
+}
+
+Vector3f FastPaintTexture::get_default_view_pos() const {
+    return Vector3f(this->width / 2, this->height / 2, 1000);
+}
+
+std::tuple<RGBImage*, RGBImage*, GrayImage*> FastPaintTexture::fast_paint_texture(Shader *shader, Vector3f view_pos, std::vector<Light> lights) {
+    RGBImage *paint_image, *texture_image;
+    GrayImage *height_map;
 
-    Vector3f view_pos = Vector3f(this->width / 2, this->height / 2, 1000);
+    if (this->source_image == nullptr) {
+        throw std::invalid_argument("Unable to paint: render-only instances have no input image.");
+    }
+
+    this->preview_shader = shader;
+    this->preview_view_pos = view_pos;
+    this->preview_lights = lights;
+
+    // Parallel loops started by this thread stop scheduling chunks once the painting is cancelled
+    Parallel::CancellationScope scope(this->cancellation);
 
     std::tie<RGBImage*, GrayImage*>(paint_image, height_map) = this->paint();
 
-    texture_image = this->texture(paint_image, height_map, shader, view_pos, lights);
+    // Freed if waiting for the previews or texturing throws
+    std::unique_ptr<RGBImage> paint_owner(paint_image);
+    std::unique_ptr<GrayImage> height_owner(height_map);
+    this->wait_for_previews();
+
+    if (paint_image == nullptr) {
+        return std::tuple<RGBImage*, RGBImage*, GrayImage*>(nullptr, nullptr, nullptr);
+    }
+
+    // Texturing is skipped if only the painting is needed
+    texture_image = shader != nullptr ? this->texture(paint_image, height_map, shader, view_pos, lights) : nullptr;
 
-    return std::tuple<RGBImage*, RGBImage*, GrayImage*>(texture_image, paint_image, height_map);
+    // Tiles skipped by a cancellation leave the textured image incomplete
+    if (Parallel::is_cancelled()) {
+        delete texture_image;
+        return std::tuple<RGBImage*, RGBImage*, GrayImage*>(nullptr, nullptr, nullptr);
+    }
+
+    return std::tuple<RGBImage*, RGBImage*, GrayImage*>(texture_image, paint_owner.release(), height_owner.release());
 }
 
 std::tuple<RGBImage*, GrayImage*> FastPaintTexture::paint() {
     int brushes[ProgramParameters::num_layers];
-    RGBImage *canvas, *ref_image;
+    RGBImage *canvas;
     GrayImage *height_map;
-    GaussianKernel kernel;
-    float sigma;
-    int kernel_len;
 
     // Create the painting canvas
-    canvas = new RGBImage(width, height, this->source_image->average_colour());
+    Vector3f background = this->source_image->average_colour();
+    canvas = new RGBImage(width, height, background);
     height_map = new GrayImage(width, height, 0.0f);
 
+    if (this->stroke_list != nullptr) {
+        *this->stroke_list = StrokeList(this->width, this->height, background);
+    }
+
     // Create brushes (from largest to smallest)
     brushes[ProgramParameters::num_layers - 1] = ProgramParameters::min_brush_size;
     for (int i = ProgramParameters::num_layers - 2; i >= 0; i--) {
         brushes[i] = 2 * brushes[i + 1];
     }
 
-    // TODO: Move elsewhere?
-    std::fill_n(this->counters, width * height, 0);
-    std::fill_n(this->old_colours, width * height, canvas->get_pixel(0, 0));
-    std::fill_n(this->total_mask, width * height, 0.0f);
-    // TODO: Move elsewhere?
+    // The compositing scratch is invalidated per stroke, so only the stroke count needs resetting
     this->cur_counter = 0;
     
-    for (int brush_radius : brushes) {
-        std::cout << "Painting layer with brush radius: " << brush_radius << std::endl;
+    this->preview_sequence = 0;
+
+    this->paint_start = std::chrono::steady_clock::now();
+    int total_rendered = 0;
+    this->skipped_error = 0.0;
+    this->skipped_strokes = 0;
+    this->skipped_layers = 0;
+    this->layer_measured = false;
+    this->duplicate_strokes = 0;
+    this->unimportant_strokes = 0;
+
+    // Cached blurred images are keyed by the stored source pixels
+    std::string source_key;
+    if (this->cache != nullptr) {
+        Hasher hasher;
+        hasher.add(static_cast<const RGBImage *>(this->source_image));
+        source_key = hasher.get_key();
+    }
 
-        // Standard deviation used for Gaussian blur
-        sigma = ProgramParameters::blur_factor * brush_radius;
-        // Length of the Gaussian kernel window
-        kernel_len = std::max(8 * sigma, 3.0f);
+    this->progress = PaintProgress {0, ProgramParameters::num_layers, 0, 0, 0, 0, 0};
+
+    // The reference of each layer only depends on the source image, so the reference of the next 
+    // layer is prepared in the background while the current layer is painted
+    auto prepare = [this, &source_key](int radius) {
+        Parallel::CancellationScope scope(this->cancellation);
+        return this->prepare_layer(radius, source_key);
+    };
+    std::future<LayerReference> next_reference = std::async(std::launch::async, prepare, brushes[0]);
+
+    for (int layer = 0; layer < ProgramParameters::num_layers && !Parallel::is_cancelled(); layer++) {
+        int brush_radius = brushes[layer];
+        this->cur_layer = layer;
+
+        LayerReference reference = next_reference.get();
+
+        // A spent budget leaves the remaining layers unpainted
+        if (!this->within_budget(total_rendered)) {
+            delete reference.ref_image;
+            delete reference.gradients;
+            delete reference.edges;
+            this->skipped_layers = ProgramParameters::num_layers - layer;
+            break;
+        }
+        if (layer + 1 < ProgramParameters::num_layers) {
+            next_reference = std::async(std::launch::async, prepare, brushes[layer + 1]);
+        }
 
-        kernel = GaussianKernel(kernel_len, sigma);
+        std::cout << "Painting layer with brush radius: " << brush_radius << std::endl;
 
-        // Apply Gaussian blur
-        ref_image = this->source_image->gaussian_blur(&kernel);
+        // Split what is left of the budget evenly across the remaining layers
+        int remaining_layers = ProgramParameters::num_layers - layer;
+        if (this->budget.time_ms > 0.0) {
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - this->paint_start;
+            double layer_ms = std::max(this->budget.time_ms - elapsed.count(), 0.0) / remaining_layers;
+            this->layer_deadline = std::chrono::steady_clock::now() + 
+                std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double, std::milli>(layer_ms));
+        }
+        if (this->budget.strokes > 0) {
+            this->layer_stroke_limit = (this->budget.strokes - total_rendered) / remaining_layers;
+        }
 
         // Paint a layer
-        this->paint_layer(ref_image, canvas, height_map, brush_radius);
+        this->progress.layer = layer;
+        this->progress.total_strokes = total_rendered;
+        total_rendered += this->paint_layer(reference, canvas, height_map, brush_radius);
 
         // Free memory
-        delete ref_image;
+        delete reference.ref_image;
+        delete reference.gradients;
+        delete reference.edges;
+
+        if (!Parallel::is_cancelled()) {
+            this->publish_preview(canvas, height_map, true);
+        }
+    }
+
+    // A cancelled painting may stop with the next reference still being prepared
+    if (next_reference.valid()) {
+        LayerReference reference = next_reference.get();
+        delete reference.ref_image;
+        delete reference.gradients;
+        delete reference.edges;
+    }
+
+    if (Parallel::is_cancelled()) {
+        delete canvas;
+        delete height_map;
+        return std::tuple<RGBImage*, GrayImage*>(nullptr, nullptr);
+    }
+
+    if (this->budget.is_limited()) {
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - this->paint_start;
+
+        std::cout << "Budgeted painting: " << total_rendered << " strokes rendered in " << elapsed.count() << " ms, " << 
+            this->skipped_strokes << " strokes skipped";
+        if (this->skipped_layers > 0) {
+            std::cout << ", " << this->skipped_layers << " layers skipped";
+        }
+        std::cout << std::endl;
+
+        if (this->skipped_strokes > 0) {
+            std::cout << "Mean area error of the skipped strokes: " << this->skipped_error / this->skipped_strokes << std::endl;
+        }
+
+        // Measuring the remaining error would overrun a spent time budget, so it is estimated instead: 
+        // the differences left by the last painted layer are those of the grid cells it did not paint over
+        if (this->budget.time_ms <= 0.0 || elapsed.count() < this->budget.time_ms) {
+            // Mean difference between the source image and the painting
+            GrayImage *differences = this->source_image->difference(canvas);
+            double remaining_error = 0.0;
+            for (int y = 0; y < this->height; y++) {
+                for (int x = 0; x < this->width; x++) {
+                    remaining_error += differences->get_pixel(x, y);
+                }
+            }
+            remaining_error /= this->width * this->height;
+            delete differences;
+
+            std::cout << "Remaining error: " << remaining_error << " per pixel" << std::endl;
+        }
+        else if (this->layer_measured) {
+            double remaining_error = std::max(this->layer_error - this->layer_rendered_error, 0.0) / (this->width * this->height);
+            std::cout << "Estimated remaining error: " << remaining_error << " per pixel (against the blurred reference of the last painted layer)" << std::endl;
+        }
+        else {
+            std::cout << "Remaining error: unknown (no layer was painted)" << std::endl;
+        }
     }
     return std::tuple<RGBImage*, GrayImage*>(canvas, height_map);
 }
@@ -98,86 +271,452 @@ RGBImage *FastPaintTexture::texture(RGBImage *image, GrayImage *height_map, Shad
     // Sobel kernels used to compute image gradient
     HorizontalSobelKernel sobel_x = HorizontalSobelKernel::get_instance();
     VerticalSobelKernel sobel_y = VerticalSobelKernel::get_instance();
-    RGBImage *normals = height_map->compute_normals(&sobel_x, &sobel_y);
-
-    Vector3f pos, new_colour, pixel;
+    VectorMatrix *normals = height_map->compute_normals(&sobel_x, &sobel_y);
 
     RGBMatrix *shaded_image = new RGBMatrix(this->height, this->width);
 
-    for (int y = 0; y < this->height; y++) {
-        for (int x = 0; x < this->width; x++) {
-            pos = Vector3f(x, y, 0);
-            pixel = image->get_pixel(x, y);
-            new_colour = shader->shade(pixel, pos, lights, view_pos, normals->get_pixel(x, y));
-            ImageUtil::set_pixel(shaded_image, x, y, new_colour);
-        }
+    if (this->distant_lights) {
+        ShadingTable table = ShadingTable(shader, lights, view_pos, Vector3f(this->width / 2, this->height / 2, 0));
+
+        #if defined(PRECISION_UINT8) || defined(PRECISION_UINT16)
+            Parallel::parallel_for_tiles(this->width, this->height, 64, [&](int x_begin, int y_begin, int x_end, int y_end) {
+                for (int y = y_begin; y < y_end; y++) {
+                    for (int x = x_begin; x < x_end; x++) {
+                        ImageUtil::set_pixel(shaded_image, x, y, table.shade(image->get_pixel(x, y), (*normals)(y, x)));
+                    }
+                }
+            });
+        #else
+            // Single precision storage: tile columns are contiguous runs of packed floats
+            Parallel::parallel_for_tiles(this->width, this->height, 64, [&](int x_begin, int y_begin, int x_end, int y_end) {
+                for (int x = x_begin; x < x_end; x++) {
+                    size_t offset = 3 * ((size_t) x * this->height + y_begin);
+                    table.shade(image->get_image()->data()->data() + offset, normals->data()->data() + offset, y_end - y_begin, 
+                        shaded_image->data()->data() + offset);
+                }
+            });
+        #endif
+
+        delete normals;
+        return new RGBImage(this->width, this->height, shaded_image);
     }
 
+    // Each pixel is only shaded with the lights that reach its tile
+    LightGrid light_grid = LightGrid(lights, this->width, this->height, 16);
+
+    Parallel::parallel_for_tiles(this->width, this->height, 64, [&](int x_begin, int y_begin, int x_end, int y_end) {
+        Vector3f pos, new_colour, pixel;
+
+        for (int y = y_begin; y < y_end; y++) {
+            for (int x = x_begin; x < x_end; x++) {
+                const std::vector<Light> &tile_lights = light_grid.get_lights(x, y);
+
+                pos = Vector3f(x, y, 0);
+                pixel = image->get_pixel(x, y);
+                new_colour = shader->shade(pixel, pos, tile_lights.data(), tile_lights.size(), light_grid.get_num_scene_lights(), 
+                    view_pos, (*normals)(y, x));
+                ImageUtil::set_pixel(shaded_image, x, y, new_colour);
+            }
+        }
+    });
+
     // Free memory
     delete normals;
 
     return new RGBImage(this->width, this->height, shaded_image);
 }
 
-void FastPaintTexture::paint_layer(RGBImage *ref_image, RGBImage *canvas, GrayImage *height_map, int radius) {
+void FastPaintTexture::publish_preview(RGBImage *canvas, GrayImage *height_map, bool wait) {
+    if (!this->preview_callback || this->preview_shader == nullptr) {
+        return;
+    }
+
+    // Only one preview is textured at a time
+    if (!this->preview_task.is_done()) {
+        if (!wait) {
+            return;
+        }
+        Parallel::wait(this->preview_task);
+    }
+
+    // Snapshot the canvas and height map. The snapshots are freed with the task, even if it is cancelled before it runs
+    std::shared_ptr<RGBImage> canvas_copy(new RGBImage(this->width, this->height, new RGBMatrix(*canvas->get_image())));
+    std::shared_ptr<GrayImage> height_copy(new GrayImage(this->width, this->height, new GrayMatrix(*height_map->get_image())));
+    int sequence = this->preview_sequence++;
+    int layer = this->cur_layer;
+
+    // Textured on the scheduler (and cancelled with the painting)
+    this->preview_task = Parallel::run_async([this, canvas_copy, height_copy, sequence, layer]() {
+        RGBImage *preview = this->texture(canvas_copy.get(), height_copy.get(), this->preview_shader, this->preview_view_pos, this->preview_lights);
+        this->preview_callback(sequence, layer, preview);
+        delete preview;
+    });
+}
+
+FastPaintTexture::LayerReference FastPaintTexture::prepare_layer(int radius, const std::string &source_key) {
+    // The layer will be skipped, so it is not blurred
+    if (!this->within_budget(0)) {
+        return LayerReference {nullptr, nullptr, nullptr};
+    }
+
+    // Standard deviation used for Gaussian blur
+    float sigma = ProgramParameters::blur_factor * radius;
+    // Length of the Gaussian kernel window
+    int kernel_len = std::max(8 * sigma, 3.0f);
+
+    GaussianKernel kernel = GaussianKernel(kernel_len, sigma);
+
+    // Sobel kernels used to compute image gradient
+    HorizontalSobelKernel sobel_x = HorizontalSobelKernel::get_instance();
+    VerticalSobelKernel sobel_y = VerticalSobelKernel::get_instance();
+
+    LayerReference reference;
+
+    // Apply Gaussian blur
+    reference.ref_image = this->blur_source(&kernel, source_key);
+
+    // Gradients of the luminosity are used to trace the strokes
+    GrayImage *luminosity = reference.ref_image->luminosity();
+    reference.gradients = luminosity->compute_gradients(&sobel_x, &sobel_y);
+    reference.edges = this->importance.source == ImportanceSource::EDGES ? luminosity->compute_edges(&sobel_x, &sobel_y) : nullptr;
+    delete luminosity;
+
+    return reference;
+}
+
+RGBImage *FastPaintTexture::blur_source(GaussianKernel *kernel, const std::string &source_key) {
+    if (this->cache == nullptr) {
+        return this->source_image->gaussian_blur(kernel);
+    }
+
+    std::string key = CacheKey::reference(source_key, kernel) + ".ref";
+    RGBImage *ref_image = this->cache->lookup(key) ? this->cache->load_image(key, this->width, this->height) : nullptr;
+    if (ref_image == nullptr) {
+        ref_image = this->source_image->gaussian_blur(kernel);
+
+        // A cancelled blur is incomplete
+        if (!Parallel::is_cancelled()) {
+            this->cache->save_image(key, ref_image);
+        }
+    }
+    return ref_image;
+}
+
+void FastPaintTexture::report_progress(int layer_strokes) {
+    if (!this->progress_callback) {
+        return;
+    }
+    this->progress.layer_strokes = layer_strokes;
+    this->progress_callback(this->progress);
+}
+
+void FastPaintTexture::wait_for_previews() {
+    Parallel::wait(this->preview_task);
+    this->preview_task = Parallel::TaskHandle();
+}
+
+bool FastPaintTexture::within_layer_budget(int rendered) const {
+    if (this->budget.strokes > 0 && rendered >= this->layer_stroke_limit) {
+        return false;
+    }
+    if (this->budget.time_ms > 0.0 && std::chrono::steady_clock::now() >= this->layer_deadline) {
+        return false;
+    }
+    return true;
+}
+
+bool FastPaintTexture::within_budget(int rendered) const {
+    if (this->budget.strokes > 0 && rendered >= this->budget.strokes) {
+        return false;
+    }
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - this->paint_start;
+    if (this->budget.time_ms > 0.0 && elapsed.count() >= this->budget.time_ms) {
+        return false;
+    }
+    return true;
+}
+
+void FastPaintTexture::find_seed_cells(int grid, int col_begin, int row_begin, int col_end, int row_end, 
+                                       std::vector<std::vector<int>> &row_cells) const {
+    // The search windows of the cells reach half a cell beyond the node. Cells are judged by 
+    // single-precision sums, so the threshold is lowered slightly to cover their rounding
+    double error = this->difference_table.get_sum(col_begin * grid - grid / 2, row_begin * grid - grid / 2, 
+        (col_end - 1) * grid + grid / 2 + 1, (row_end - 1) * grid + grid / 2 + 1);
+    double cell_threshold = 0.999 * ProgramParameters::threshold * grid * grid;
+    if (error < cell_threshold) {
+        return;
+    }
+
+    // Most cells of a node with this much error hold a seed, so every cell is scanned instead of descending further
+    int num_cells = (col_end - col_begin) * (row_end - row_begin);
+    if (num_cells == 1 || error >= cell_threshold * num_cells) {
+        for (int row = row_begin; row < row_end; row++) {
+            for (int col = col_begin; col < col_end; col++) {
+                row_cells[row].push_back(col);
+            }
+        }
+        return;
+    }
+
+    // Children are visited left to right, top to bottom, so every row gets its cells in increasing column order
+    int col_mid = col_begin + (col_end - col_begin + 1) / 2;
+    int row_mid = row_begin + (row_end - row_begin + 1) / 2;
+    int row_bounds[3] = {row_begin, row_mid, row_end};
+    int col_bounds[3] = {col_begin, col_mid, col_end};
+    for (int i = 0; i < 2; i++) {
+        for (int j = 0; j < 2; j++) {
+            if (row_bounds[i] < row_bounds[i + 1] && col_bounds[j] < col_bounds[j + 1]) {
+                this->find_seed_cells(grid, col_bounds[j], row_bounds[i], col_bounds[j + 1], row_bounds[i + 1], row_cells);
+            }
+        }
+    }
+}
+
+int FastPaintTexture::suppress_duplicates(std::vector<StrokeSeed> &seeds, int radius, int grid) const {
+    // A tolerance of 0 (small brushes) only drops exact duplicates
+    int tolerance = (int) (ProgramParameters::duplicate_fac * radius);
+
+    // Kept seeds of every grid cell, as linked lists of seed indices
+    int grid_cols = Parallel::get_num_chunks(0, this->width, grid);
+    int grid_rows = Parallel::get_num_chunks(0, this->height, grid);
+    std::vector<int> cell_head((size_t) grid_cols * grid_rows, -1);
+    std::vector<int> next_kept(seeds.size());
+    // Cells within the tolerance of a cell (only its own cell for a tolerance of 0)
+    int reach = (tolerance + grid - 1) / grid;
+
+    size_t kept = 0;
+    for (size_t i = 0; i < seeds.size(); i++) {
+        const StrokeSeed seed = seeds[i];
+        int col = seed.x / grid, row = seed.y / grid;
+
+        bool duplicate = false;
+        for (int r = std::max(row - reach, 0); r <= std::min(row + reach, grid_rows - 1) && !duplicate; r++) {
+            for (int c = std::max(col - reach, 0); c <= std::min(col + reach, grid_cols - 1) && !duplicate; c++) {
+                for (int k = cell_head[(size_t) r * grid_cols + c]; k != -1; k = next_kept[k]) {
+                    if (std::abs(seeds[k].x - seed.x) <= tolerance && std::abs(seeds[k].y - seed.y) <= tolerance) {
+                        duplicate = true;
+                        break;
+                    }
+                }
+            }
+        }
+        if (duplicate) {
+            continue;
+        }
+
+        // Kept seeds are compacted to the front, so seeds[kept] stays valid
+        size_t cell = (size_t) row * grid_cols + col;
+        next_kept[kept] = cell_head[cell];
+        cell_head[cell] = kept;
+        seeds[kept++] = seed;
+    }
+
+    int dropped = seeds.size() - kept;
+    seeds.resize(kept);
+    return dropped;
+}
+
+int FastPaintTexture::paint_layer(const LayerReference &reference, RGBImage *canvas, GrayImage *height_map, int radius) {
+    std::vector<StrokeSeed> seeds;
     std::vector<Stroke> strokes;
-    GrayImage *differences, *luminosity;
-    int grid, max_x, max_y;
-    float area_error, max_diff, current_diff;
+    RGBImage *ref_image = reference.ref_image;
+    GrayImage *differences;
+    int grid;
 
     // Compute the difference between the reference image and the canvas
-    differences = ref_image->difference(canvas);
-
-    // Compute the luminosity of the reference image. Used to compute image gradients
-    luminosity = ref_image->luminosity();
+    differences = new GrayImage(this->width, this->height, new GrayMatrix(this->height, this->width));
+    ref_image->preprocess(canvas, differences, nullptr);
 
     // Brush mask
     AntiAliasedCircle brush = AntiAliasedCircle(radius, ProgramParameters::aa * radius);
 
     grid = std::max((int) ProgramParameters::grid_fac * radius, 1);
 
-    for (int y = 0; y < this->height; y += grid) {
-        for (int x = 0; x < this->width; x+= grid) {
-            // Reset area error, maximum difference, and maximum difference coordiantes
-            area_error = 0.0f;
-            max_x = x, max_y = y;
-            max_diff = 0.0f;
-
-            // Iterate over differences surrounding the current point
-            for (int j = y - (grid / 2); j <= y + (grid / 2); j++) {
-                for (int i = x -(grid / 2); i <= x + (grid / 2); i++) {
-                    // Checks if coordinates are valid
-                    if (i < 0 || i >= this->width || j < 0 || j >= this->height) {
+    int grid_rows = Parallel::get_num_chunks(0, this->height, grid);
+    int grid_cols = Parallel::get_num_chunks(0, this->width, grid);
+
+    // Columns of the grid cells of each row that are scanned for a seed
+    std::vector<std::vector<int>> row_cells(grid_rows);
+    // Budgeted paintings estimate their remaining error from the sum of the differences
+    if (this->stroke_placement == StrokePlacement::QUADTREE || this->budget.is_limited()) {
+        this->difference_table.compute(differences);
+    }
+    if (this->stroke_placement == StrokePlacement::QUADTREE) {
+        this->find_seed_cells(grid, 0, 0, grid_cols, grid_rows, row_cells);
+    }
+    else {
+        for (std::vector<int> &cells : row_cells) {
+            cells.resize(grid_cols);
+            std::iota(cells.begin(), cells.end(), 0);
+        }
+    }
+
+    // Every layer but the coarsest judges its cells against the threshold scaled by the importance of 
+    // their seeds. The coarsest layer covers the canvas, unless it is the only layer
+    bool use_importance = this->importance.is_enabled() && (this->cur_layer > 0 || ProgramParameters::num_layers == 1);
+    std::vector<int> row_unimportant(grid_rows, 0);
+
+    // Seeds of each grid row are found in parallel and concatenated in raster order
+    std::vector<std::vector<StrokeSeed>> row_seeds(grid_rows);
+
+    Parallel::parallel_for(0, grid_rows, 4, [&](int row_begin, int row_end) {
+        int max_x, max_y;
+        float area_error, max_diff, current_diff;
+
+        for (int row = row_begin; row < row_end; row++) {
+            int y = row * grid;
+            for (int col : row_cells[row]) {
+                int x = col * grid;
+                // Reset area error, maximum difference, and maximum difference coordiantes
+                area_error = 0.0f;
+                max_x = x, max_y = y;
+                max_diff = 0.0f;
+
+                // Iterate over differences surrounding the current point
+                for (int j = y - (grid / 2); j <= y + (grid / 2); j++) {
+                    for (int i = x -(grid / 2); i <= x + (grid / 2); i++) {
+                        // Checks if coordinates are valid
+                        if (i < 0 || i >= this->width || j < 0 || j >= this->height) {
+                            continue;
+                        }
+
+                        current_diff = differences->get_pixel(i, j); // TODO: Fix index
+
+                        // Sum the error ear (x, y)
+                        area_error += current_diff;
+
+                        // Check if the current difference is greater than the maximum difference
+                        if (current_diff > max_diff) {
+                            max_x = i;
+                            max_y = j;
+                            max_diff = current_diff;
+                        }
+                    }
+                }
+                // It is cheaper to check this than dividing area_error by grid * grid
+                if (area_error > ProgramParameters::threshold * grid * grid) {
+                    if (use_importance && !(area_error > ProgramParameters::threshold * grid * grid * 
+                        this->importance.get_threshold_scale(max_x, max_y, reference.edges))) {
+                        row_unimportant[row]++;
                         continue;
                     }
+                    row_seeds[row].push_back({max_x, max_y, area_error});
+                }
+            }
+        }
+    });
+
+    for (const std::vector<StrokeSeed> &row : row_seeds) {
+        seeds.insert(seeds.end(), row.begin(), row.end());
+    }
+    this->unimportant_strokes += std::accumulate(row_unimportant.begin(), row_unimportant.end(), 0);
+    this->progress.unimportant_strokes = this->unimportant_strokes;
+    this->duplicate_strokes += this->suppress_duplicates(seeds, radius, grid);
+    this->progress.duplicate_strokes = this->duplicate_strokes;
 
-                    current_diff = differences->get_pixel(i, j); // TODO: Fix index
+    int rendered = 0;
 
-                    // Sum the error ear (x, y)
-                    area_error += current_diff;
+    this->progress.layer_total = seeds.size();
+    if (this->budget.strokes > 0) {
+        this->progress.layer_total = std::min(this->progress.layer_total, this->layer_stroke_limit);
+    }
+    this->report_progress(0);
 
-                    // Check if the current difference is greater than the maximum difference
-                    if (current_diff > max_diff) {
-                        max_x = i;
-                        max_y = j;
-                        max_diff = current_diff;
-                    }
-                }
+    // Budgeted: trace and render the strokes that reduce the most error first, until the layer budget runs out
+    if (this->budget.is_limited()) {
+        std::stable_sort(seeds.begin(), seeds.end(), [](const StrokeSeed &a, const StrokeSeed &b) {
+            return a.area_error > b.area_error;
+        });
+
+        // Strokes are traced against the canvas as it was before the layer, like unbudgeted layers, 
+        // so a budgeted layer renders a subset of the strokes of an unbudgeted one
+        RGBImage *layer_canvas = new RGBImage(this->width, this->height, new RGBMatrix(*canvas->get_image()));
+
+        this->layer_measured = true;
+        this->layer_error = this->difference_table.get_sum(0, 0, this->width, this->height);
+        this->layer_rendered_error = 0.0;
+
+        for (const StrokeSeed &seed : seeds) {
+            if (Parallel::is_cancelled()) {
+                break;
             }
-            // It is cheaper to check this than dividing area_error by grid * grid
-            if (area_error > ProgramParameters::threshold * grid * grid) {
-                Stroke stroke = Stroke(max_x, max_y, radius, ref_image, canvas, luminosity, this->height_texture, this->opacity_texture);
-                strokes.push_back(stroke);
+            if (!this->within_layer_budget(rendered)) {
+                this->skipped_error += seed.area_error;
+                this->skipped_strokes++;
+                continue;
+            }
+            Stroke stroke = Stroke(seed.x, seed.y, radius, ref_image, layer_canvas, reference.gradients, this->sampler);
+            this->render_stroke(canvas, height_map, &stroke, &brush);
+            this->layer_rendered_error += this->difference_table.get_sum(seed.x - grid / 2, seed.y - grid / 2, 
+                seed.x - grid / 2 + grid, seed.y - grid / 2 + grid);
+            rendered++;
+
+            if (this->stroke_list != nullptr) {
+                this->stroke_list->add(&stroke, this->cur_layer);
+            }
+
+            if (this->preview_stroke_interval > 0 && rendered % this->preview_stroke_interval == 0) {
+                this->publish_preview(canvas, height_map, false);
+            }
+            if (this->progress_stroke_interval > 0 && rendered % this->progress_stroke_interval == 0) {
+                this->report_progress(rendered);
             }
+
+            #ifdef ANIMATE
+                cv::Mat *cv_canvas = canvas->to_cv_mat();
+                cv::imshow("canvas", *cv_canvas);
+                cv::waitKey(1);
+                delete cv_canvas;
+            #endif
         }
+        delete layer_canvas;
+        delete differences;
+
+        if (!Parallel::is_cancelled()) {
+            this->report_progress(rendered);
+        }
+        return rendered;
+    }
+
+    // Every stroke is traced against the same canvas, so the strokes are traced in parallel, in batches
+    std::vector<Vector2i> positions(seeds.size());
+    for (size_t i = 0; i < seeds.size(); i++) {
+        positions[i] = Vector2i(seeds[i].x, seeds[i].y);
     }
+    strokes.resize(seeds.size());
+    Parallel::parallel_for(0, seeds.size(), Simd::trace_lanes, [&](int begin, int end) {
+        Stroke::trace(positions.data() + begin, end - begin, radius, ref_image, canvas, reference.gradients, this->sampler, 
+            strokes.data() + begin);
+    });
     // Free memory
     delete differences;
-    delete luminosity;
+
+    // Strokes whose tracing was skipped by a cancellation are never ordered or rendered
+    if (Parallel::is_cancelled()) {
+        return rendered;
+    }
+    std::vector<int> order = StrokeOrdering::get_order(strokes, this->stroke_order, this->width, this->height, this->cur_layer);
 
     // Render the strokes to the canvas
-    for (Stroke stroke : strokes) {
+    for (int i : order) {
+        if (Parallel::is_cancelled()) {
+            return rendered;
+        }
+        Stroke &stroke = strokes[i];
         this->render_stroke(canvas, height_map, &stroke, &brush);
+        rendered++;
+
+        if (this->stroke_list != nullptr) {
+            this->stroke_list->add(&stroke, this->cur_layer);
+        }
+
+        // The layer preview is published by paint
+        if (this->preview_stroke_interval > 0 && rendered % this->preview_stroke_interval == 0 && rendered < (int) strokes.size()) {
+            this->publish_preview(canvas, height_map, false);
+        }
+        if (this->progress_stroke_interval > 0 && rendered % this->progress_stroke_interval == 0 && rendered < (int) strokes.size()) {
+            this->report_progress(rendered);
+        }
 
         #ifdef ANIMATE
             cv::Mat *cv_canvas = canvas->to_cv_mat();
@@ -185,74 +724,133 @@ void FastPaintTexture::paint_layer(RGBImage *ref_image, RGBImage *canvas, GrayIm
             cv::waitKey(1);
             delete cv_canvas;
         #endif
-    }    
+    }
+    this->report_progress(rendered);
+    return rendered;
 }
 
-// TODO: Move this into the GrayImage class?
-float FastPaintTexture::compose_height(float stroke_height, float stroke_opacity, float current_height) {
-    float height_blend = ImageUtil::alpha_blend(stroke_height, current_height, stroke_opacity / 255);
+std::tuple<RGBImage*, GrayImage*> FastPaintTexture::render(const StrokeList *stroke_list) {
+    RGBImage *canvas = new RGBImage(this->width, this->height, stroke_list->get_background());
+    GrayImage *height_map = new GrayImage(this->width, this->height, 0.0f);
+
+    // Scale from the canvas the strokes were painted on
+    float scale_x = (float) this->width / stroke_list->get_width();
+    float scale_y = (float) this->height / stroke_list->get_height();
+    float scale_radius = std::sqrt(scale_x * scale_y);
+
+    // Brush masks of every (scaled) radius in the list
+    std::map<int, AntiAliasedCircle> brushes;
+    std::vector<Vector2f> points;
+
+    this->cur_counter = 0;
+
+    for (int i = 0; i < stroke_list->get_num_strokes(); i++) {
+        const StrokeList::Record &record = stroke_list->get_record(i);
+        const Vector2f *control_points = stroke_list->get_points(i);
 
-    return height_blend + 0.001f * this->cur_counter;
+        int radius = std::max((int) std::lround(record.radius * scale_radius), 1);
+        if (brushes.find(radius) == brushes.end()) {
+            brushes[radius] = AntiAliasedCircle(radius, ProgramParameters::aa * radius);
+        }
+
+        points.resize(record.num_points);
+        for (int j = 0; j < record.num_points; j++) {
+            points[j] = Vector2f(control_points[j].x() * scale_x, control_points[j].y() * scale_y);
+        }
+
+        this->cur_layer = record.layer;
+        Stroke stroke = Stroke(points.data(), record.num_points, radius, 
+            Vector3f(record.colour[0], record.colour[1], record.colour[2]), this->width, this->height, this->sampler);
+        this->render_stroke(canvas, height_map, &stroke, &brushes[radius]);
+    }
+    return std::tuple<RGBImage*, GrayImage*>(canvas, height_map);
 }
 
 void FastPaintTexture::render_stroke(RGBImage *canvas, GrayImage *height_map, Stroke *stroke, AntiAliasedCircle *mask) {
-    std::vector<Vector2f> limit = stroke->get_limit();
+    this->limit.resize(stroke->get_limit_size());
+    stroke->compute_limit(this->limit.data());
 
     this->cur_counter++; // TODO: Does this need to be global
     this->cur_colour = stroke->get_colour(); // TODO: Is this really needed if we are passing color
 
-    if (limit.size() == 1) {
-        this->render_stroke_point(canvas, height_map, stroke, limit[0].x(), limit[0].y(), mask);
+    // Start a fresh compositing scratch for the stroke
+    this->footprint.begin(this->limit.data(), this->limit.size(), mask, this->width, this->height);
+
+    if (this->limit.size() == 1) {
+        this->render_stroke_point(canvas, height_map, stroke, this->limit[0].x(), this->limit[0].y(), mask);
         return;
     }
 
-    for (int i = 0; i < limit.size() - 1; i++) {
-        this->render_stroke_line(canvas, height_map, stroke, limit[i].x(), limit[i].y(), limit[i + 1].x(), limit[i + 1].y(), mask);
+    for (int i = 0; i < (int) this->limit.size() - 1; i++) {
+        this->render_stroke_line(canvas, height_map, stroke, this->limit[i].x(), this->limit[i].y(), this->limit[i + 1].x(), this->limit[i + 1].y(), mask);
     }
 }
 
 void FastPaintTexture::render_stroke_point(RGBImage *canvas, GrayImage *height_map, Stroke *stroke, int x, int y, AntiAliasedCircle *mask) {
-    int new_x, new_y, ind;
-    float alpha, composed_height;
-    Vector3f blended_colour;
-
+    int new_x, new_y, n;
+    float alpha;
+    Vector3f colour;
+    uint32_t epoch = this->footprint.get_epoch();
+
+    const Simd::KernelTable &kernels = Simd::get();
+    const float stroke_colour[3] = {this->cur_colour.x(), this->cur_colour.y(), this->cur_colour.z()};
+    const float height_offset = 0.001f * this->cur_counter;
+
+    CompositeBatch &batch = this->composite_batch;
+    batch.resize(mask->get_len());
+
+    // Mask columns are contiguous rows of the canvas (column-major). The pixels of a column that 
+    // the stamp changes are gathered and blended in one batch
+    for (int i = 0; i < mask->get_len(); i++) {
+        new_x = x + i - mask->get_centre_x();
+        if (new_x < 0 || new_x >= this->width) {
+            continue;
+        }
 
-    for (int j = 0; j < mask->get_len(); j++) {
-        for (int i = 0; i < mask->get_len(); i++) {
-            new_x = x + i - mask->get_centre_x();
+        n = 0;
+        for (int j = 0; j < mask->get_len(); j++) {
             new_y = y + j - mask->get_centre_y();
-
-            // Checks if the coordinates are valid
-            if (new_x < 0 || new_x >= this->width || new_y < 0 || new_y >= this->height) {
+            if (new_y < 0 || new_y >= this->height) {
                 continue;
             }
 
             alpha = mask->get_value(i, j);
 
-            ind = new_y * this->width + new_x;
-
-            if (this->counters[ind] < this->cur_counter) {
-                this->counters[ind] = this->cur_counter;
-                this->old_colours[ind] = canvas->get_pixel(new_x, new_y);
-                this->total_mask[ind] = alpha;
-                
-                blended_colour = ImageUtil::alpha_blend(this->cur_colour, this->old_colours[ind], alpha);
-                canvas->set_pixel(new_x, new_y, blended_colour);
+            StrokeFootprint::Record &record = this->footprint.get_record(new_x, new_y);
 
-                composed_height = this->compose_height(stroke->get_height(new_x, new_y), stroke->get_opacity(new_x, new_y), height_map->get_pixel(new_x, new_y));
-                height_map->set_pixel(new_x, new_y, composed_height);
+            // First visit of the pixel by this stroke
+            if (record.epoch != epoch) {
+                record.epoch = epoch;
+                record.old_colour = ImageUtil::store_colour(canvas->get_pixel(new_x, new_y));
+                record.mask = alpha;
+                record.sample = stroke->get_texture_sample(new_x, new_y);
+            } 
+            else if (record.mask < alpha) {
+                record.mask = alpha;
             } 
             else {
-                if (this->total_mask[ind] < alpha) {
-                    this->total_mask[ind] = alpha;
-                    
-                    blended_colour = ImageUtil::alpha_blend(this->cur_colour, this->old_colours[ind], alpha);
-                    canvas->set_pixel(new_x, new_y, blended_colour);
-
-                    composed_height = this->compose_height(stroke->get_height(new_x, new_y), stroke->get_opacity(new_x, new_y), height_map->get_pixel(new_x, new_y));
-                    height_map->set_pixel(new_x, new_y, composed_height);
-                }
+                continue;
             }
+
+            colour = ImageUtil::load_colour(record.old_colour);
+            batch.rows[n] = new_y;
+            batch.alphas[n] = alpha;
+            batch.opacities[n] = record.sample.opacity;
+            batch.stroke_heights[n] = record.sample.height;
+            batch.colours[3 * n] = colour.x();
+            batch.colours[3 * n + 1] = colour.y();
+            batch.colours[3 * n + 2] = colour.z();
+            batch.heights[n] = height_map->get_pixel(new_x, new_y);
+            n++;
+        }
+
+        // Blend with the stroke colour and compose the stroke height on top of the height map
+        kernels.composite(stroke_colour, height_offset, batch.alphas.data(), batch.opacities.data(), batch.stroke_heights.data(),
+            batch.colours.data(), batch.heights.data(), n);
+
+        for (int k = 0; k < n; k++) {
+            canvas->set_pixel(new_x, batch.rows[k], Vector3f(batch.colours[3 * k], batch.colours[3 * k + 1], batch.colours[3 * k + 2]));
+            height_map->set_pixel(new_x, batch.rows[k], batch.heights[k]);
         }
     }
 }
@@ -0,0 +1,345 @@
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+    #include <pthread.h>
+    #include <sched.h>
+#endif
+
+#include "parallel.hpp"
+
+namespace {
+    /**
+     * State shared by the tasks of a single parallel loop
+    */
+    struct Loop {
+        const std::function<void(int, int)> *body;
+        int begin, end, grain;
+        // Token of the thread that started the loop (can be nullptr)
+        const Parallel::CancellationToken *token;
+        // Number of chunks that have not finished yet
+        std::atomic<int> remaining;
+
+        // Loops of a single task started by run_async own their body and are freed once it has run
+        std::function<void(int, int)> owned_body;
+        std::shared_ptr<std::atomic<bool>> done;
+    };
+
+    /**
+     * A single chunk of a parallel loop
+    */
+    struct Task {
+        Loop *loop;
+        int chunk_begin;
+    };
+
+    /**
+     * Deque of tasks. The owner works at the back, thieves take from the front
+    */
+    struct TaskQueue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    // Index of the worker running on this thread (-1 for threads that are not workers)
+    thread_local int worker_index = -1;
+
+    // Cancellation token of the work running on this thread (see Parallel::CancellationScope)
+    thread_local const Parallel::CancellationToken *current_token = nullptr;
+
+    /**
+     * Work-stealing scheduler. Worker 0 is the calling thread of a loop, so only workers
+     * 1 to num_threads - 1 are started. Threads that are not workers share queue 0.
+    */
+    class Scheduler {
+        private:
+            int num_threads;
+            std::vector<std::unique_ptr<TaskQueue>> queues;
+            std::vector<std::thread> workers;
+
+            // Number of queued tasks. Idle workers sleep until it is non-zero
+            std::atomic<int> queued;
+            std::mutex sleep_mutex;
+            std::condition_variable wake;
+            bool stop = false;
+
+            /**
+             * @param index: Index of the queue
+             * @param task: Task to append to the back of the queue
+            */
+            void push(const int index, const Task task) {
+                {
+                    std::lock_guard<std::mutex> lock(this->queues[index]->mutex);
+                    this->queues[index]->tasks.push_back(task);
+                }
+                this->queued++;
+            }
+
+            /**
+             * Takes a task, preferring the back of the own queue and otherwise stealing from the
+             * front of the other queues.
+             *
+             * @param self: Index of the queue of the calling thread
+             * @param task: Output for the task
+             *
+             * @return: False if every queue is empty
+            */
+            bool take(const int self, Task &task) {
+                if (this->queued == 0) {
+                    return false;
+                }
+                {
+                    TaskQueue *own = this->queues[self].get();
+                    std::lock_guard<std::mutex> lock(own->mutex);
+                    if (!own->tasks.empty()) {
+                        task = own->tasks.back();
+                        own->tasks.pop_back();
+                        this->queued--;
+                        return true;
+                    }
+                }
+                for (int i = 1; i <= this->num_threads; i++) {
+                    TaskQueue *victim = this->queues[(self + i) % this->queues.size()].get();
+                    std::lock_guard<std::mutex> lock(victim->mutex);
+                    if (!victim->tasks.empty()) {
+                        task = victim->tasks.front();
+                        victim->tasks.pop_front();
+                        this->queued--;
+                        return true;
+                    }
+                }
+                return false;
+            }
+
+            static void run(const Task &task) {
+                Loop *loop = task.loop;
+                if (loop->token == nullptr || !loop->token->is_cancelled()) {
+                    // Loops nested in the body are cancelled with this loop
+                    const Parallel::CancellationToken *outer = current_token;
+                    current_token = loop->token;
+                    (*loop->body)(task.chunk_begin, std::min(task.chunk_begin + loop->grain, loop->end));
+                    current_token = outer;
+                }
+                if (loop->done != nullptr) {
+                    *loop->done = true;
+                    delete loop;
+                    return;
+                }
+                loop->remaining--;
+            }
+
+            void worker_main(const int index) {
+                worker_index = index;
+                Task task;
+                while (true) {
+                    if (this->take(index, task)) {
+                        run(task);
+                        continue;
+                    }
+                    std::unique_lock<std::mutex> lock(this->sleep_mutex);
+                    this->wake.wait(lock, [this]() { return this->queued > 0 || this->stop; });
+                    if (this->stop) {
+                        return;
+                    }
+                }
+            }
+
+        public:
+            Scheduler(const int num_threads, const bool pin_threads) : queued(0) {
+                this->num_threads = num_threads;
+
+                for (int i = 0; i < num_threads; i++) {
+                    this->queues.push_back(std::make_unique<TaskQueue>());
+                }
+                for (int i = 1; i < num_threads; i++) {
+                    this->workers.emplace_back(&Scheduler::worker_main, this, i);
+
+                    #ifdef __linux__
+                        if (pin_threads) {
+                            // Core 0 is left to the thread that starts the loops
+                            cpu_set_t cpus;
+                            CPU_ZERO(&cpus);
+                            CPU_SET(i % std::max((int) std::thread::hardware_concurrency(), 1), &cpus);
+                            pthread_setaffinity_np(this->workers.back().native_handle(), sizeof(cpu_set_t), &cpus);
+                        }
+                    #endif
+                }
+            }
+
+            ~Scheduler() {
+                {
+                    std::lock_guard<std::mutex> lock(this->sleep_mutex);
+                    this->stop = true;
+                }
+                this->wake.notify_all();
+                for (std::thread &worker : this->workers) {
+                    worker.join();
+                }
+            }
+
+            int get_num_threads() const {
+                return this->num_threads;
+            }
+
+            void parallel_for(const int begin, const int end, const int grain, const std::function<void(int, int)> &body) {
+                Loop loop;
+                loop.body = &body;
+                loop.begin = begin;
+                loop.end = end;
+                loop.grain = grain;
+                loop.token = current_token;
+                loop.remaining = Parallel::get_num_chunks(begin, end, grain);
+
+                // Workers push onto their own queue. Every other thread shares queue 0
+                int self = std::max(worker_index, 0);
+
+                // Queued in reverse so that the owner runs the chunks in order
+                for (int chunk_begin = begin + (loop.remaining - 1) * grain; chunk_begin >= begin; chunk_begin -= grain) {
+                    this->push(self, Task {&loop, chunk_begin});
+                }
+                {
+                    std::lock_guard<std::mutex> lock(this->sleep_mutex);
+                }
+                this->wake.notify_all();
+
+                // Help with queued tasks (of this or any other loop) until every chunk has finished
+                this->help_until([&loop]() { return loop.remaining == 0; });
+            }
+
+            Parallel::TaskHandle run_async(const std::function<void()> &task) {
+                Loop *loop = new Loop();
+                loop->owned_body = [task](int, int) { task(); };
+                loop->body = &loop->owned_body;
+                loop->begin = 0;
+                loop->end = 1;
+                loop->grain = 1;
+                loop->token = current_token;
+                loop->remaining = 1;
+                loop->done = std::make_shared<std::atomic<bool>>(false);
+                Parallel::TaskHandle handle(loop->done);
+
+                this->push(std::max(worker_index, 0), Task {loop, 0});
+                {
+                    std::lock_guard<std::mutex> lock(this->sleep_mutex);
+                }
+                this->wake.notify_all();
+                return handle;
+            }
+
+            /**
+             * Runs queued tasks (of any loop) until a condition holds.
+             *
+             * @param finished: Condition to wait for
+            */
+            void help_until(const std::function<bool()> &finished) {
+                int self = std::max(worker_index, 0);
+                Task task;
+                while (!finished()) {
+                    if (this->take(self, task)) {
+                        run(task);
+                    }
+                    else {
+                        std::this_thread::yield();
+                    }
+                }
+            }
+    };
+
+    // Scheduler configuration. The scheduler is started on first use
+    std::mutex scheduler_mutex;
+    std::unique_ptr<Scheduler> scheduler;
+    int configured_threads = 0;
+    bool configured_pinning = false;
+
+    Scheduler *get_scheduler() {
+        std::lock_guard<std::mutex> lock(scheduler_mutex);
+        if (scheduler == nullptr) {
+            int num_threads = configured_threads > 0 ? configured_threads : std::max((int) std::thread::hardware_concurrency(), 1);
+            scheduler = std::make_unique<Scheduler>(num_threads, configured_pinning);
+        }
+        return scheduler.get();
+    }
+}
+
+namespace Parallel {
+    CancellationScope::CancellationScope(const CancellationToken *token) {
+        this->previous = current_token;
+        current_token = token;
+    }
+
+    CancellationScope::~CancellationScope() {
+        current_token = this->previous;
+    }
+
+    bool is_cancelled() {
+        return current_token != nullptr && current_token->is_cancelled();
+    }
+
+    void configure(const int num_threads, const bool pin_threads) {
+        std::lock_guard<std::mutex> lock(scheduler_mutex);
+        configured_threads = std::max(num_threads, 0);
+        configured_pinning = pin_threads;
+        scheduler.reset();
+    }
+
+    int get_num_threads() {
+        return get_scheduler()->get_num_threads();
+    }
+
+    int get_num_chunks(const int begin, const int end, const int grain) {
+        if (end <= begin) {
+            return 0;
+        }
+        return (end - begin + grain - 1) / grain;
+    }
+
+    void parallel_for(const int begin, const int end, const int grain, const std::function<void(int, int)> &body) {
+        int num_chunks = get_num_chunks(begin, end, grain);
+
+        // Not worth scheduling
+        if (num_chunks <= 1 || get_num_threads() <= 1) {
+            for (int chunk_begin = begin; chunk_begin < end && !is_cancelled(); chunk_begin += grain) {
+                body(chunk_begin, std::min(chunk_begin + grain, end));
+            }
+            return;
+        }
+        get_scheduler()->parallel_for(begin, end, grain, body);
+    }
+
+    void parallel_for_tiles(const int width, const int height, const int tile_size,
+                            const std::function<void(int, int, int, int)> &body) {
+        int tiles_x = get_num_chunks(0, width, tile_size);
+        int tiles_y = get_num_chunks(0, height, tile_size);
+
+        parallel_for(0, tiles_x * tiles_y, 1, [&](int begin, int end) {
+            for (int tile = begin; tile < end; tile++) {
+                int x_begin = (tile % tiles_x) * tile_size;
+                int y_begin = (tile / tiles_x) * tile_size;
+                body(x_begin, y_begin, std::min(x_begin + tile_size, width), std::min(y_begin + tile_size, height));
+            }
+        });
+    }
+
+    TaskHandle run_async(const std::function<void()> &task) {
+        // No worker would pick the task up
+        if (get_num_threads() <= 1) {
+            if (!is_cancelled()) {
+                task();
+            }
+            return TaskHandle();
+        }
+        return get_scheduler()->run_async(task);
+    }
+
+    void wait(const TaskHandle &handle) {
+        if (!handle.is_done()) {
+            get_scheduler()->help_until([&handle]() { return handle.is_done(); });
+        }
+    }
+}
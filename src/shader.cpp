@@ -1,8 +1,11 @@
 #include "shader.hpp"
+#include "parallel.hpp"
+#include "simd.hpp"
 #include <iostream>
 #include <math.h>
 
-Vector3f BlinnPhongShader::shade(const Vector3f &colour, const Vector3f &pos, const std::vector<Light> &lights, const Vector3f &view_pos, const Vector3f &normal) {
+Vector3f BlinnPhongShader::shade(const Vector3f &colour, const Vector3f &pos, const Light *lights, const int num_lights, const int num_scene_lights, 
+                                 const Vector3f &view_pos, const Vector3f &normal) {
     float ka = 0.1f;
     float kd = 0.6f;
     float ks = 0.3f;
@@ -22,22 +25,31 @@ Vector3f BlinnPhongShader::shade(const Vector3f &colour, const Vector3f &pos, co
     // View direction
     v = (view_pos - pos).normalized();
 
-    for (Light light : lights) {
+    for (int i = 0; i < num_lights; i++) {
+        const Light &light = lights[i];
+
+        // Out of range
+        float attenuation = light.get_attenuation(pos);
+        if (attenuation == 0.0f) {
+            continue;
+        }
+        Vector3f intensity = attenuation * light.get_intensity();
+
         // Light direction 
         l = (light.get_position() - pos).normalized();
 
         // Half-vector 
         h = (v + l).normalized();
 
-        // Diffuse lighting. Fall-off not considered
+        // Diffuse lighting. Range fall-off is included in the intensity
         float N_dot_l = std::max(0.0f, normal.dot(l));
-        output_colour += kd * scaled_colour.cwiseProduct(light.get_intensity()) * N_dot_l;
+        output_colour += kd * scaled_colour.cwiseProduct(intensity) * N_dot_l;
 
-        // Specular lighting. Fall-off not considered
+        // Specular lighting. Range fall-off is included in the intensity
         float N_dot_h = std::max(0.0f, normal.dot(h));
-        output_colour += ks * light.get_intensity() * std::pow(N_dot_h, this->p);
+        output_colour += ks * intensity * std::pow(N_dot_h, this->p);
     }
-    output_colour /= lights.size();
+    output_colour /= num_scene_lights;
 
     // Clamp the colour between [0, 1]
     output_colour.cwiseMin(1.0f).cwiseMax(0.0f);
@@ -46,7 +58,8 @@ Vector3f BlinnPhongShader::shade(const Vector3f &colour, const Vector3f &pos, co
     return output_colour * 255.0f;
 }
 
-Vector3f LambertianShader::shade(const Vector3f &colour, const Vector3f &pos, const std::vector<Light> &lights, const Vector3f &view_pos, const Vector3f &normal) {
+Vector3f LambertianShader::shade(const Vector3f &colour, const Vector3f &pos, const Light *lights, const int num_lights, const int num_scene_lights, 
+                                 const Vector3f &view_pos, const Vector3f &normal) {
     Vector3f l, B_D;
 
     // Scale the input colour between [0, 1]
@@ -54,16 +67,25 @@ Vector3f LambertianShader::shade(const Vector3f &colour, const Vector3f &pos, co
 
     Vector3f output_colour = Vector3f::Zero();
 
-    for (Light light : lights) {
+    for (int i = 0; i < num_lights; i++) {
+        const Light &light = lights[i];
+
+        // Out of range
+        float attenuation = light.get_attenuation(pos);
+        if (attenuation == 0.0f) {
+            continue;
+        }
+        Vector3f intensity = attenuation * light.get_intensity();
+
         // Light direction
         l = (light.get_position() - pos).normalized();
 
         // Brightness of the diffusely reflect light
-        B_D = std::max(normal.dot(l), 0.0f) * scaled_colour.cwiseProduct(light.get_intensity());
+        B_D = std::max(normal.dot(l), 0.0f) * scaled_colour.cwiseProduct(intensity);
 
         output_colour += B_D;
     }
-    output_colour /= lights.size();
+    output_colour /= num_scene_lights;
 
     // Clamp the colour between [0, 1]
     output_colour.cwiseMin(1.0f).cwiseMax(0.0f);
@@ -74,7 +96,8 @@ Vector3f LambertianShader::shade(const Vector3f &colour, const Vector3f &pos, co
 /**
  * This implementation is based on: https://github.com/glslify/glsl-diffuse-oren-nayar/blob/master/index.glsl
 */
-Vector3f OrenNayarShader::shade(const Vector3f &colour, const Vector3f &pos, const std::vector<Light> &lights, const Vector3f &view_pos, const Vector3f &normal) {
+Vector3f OrenNayarShader::shade(const Vector3f &colour, const Vector3f &pos, const Light *lights, const int num_lights, const int num_scene_lights, 
+                                const Vector3f &view_pos, const Vector3f &normal) {
     // Scale the input colour between [0, 1]
     Vector3f scaled_colour = colour / 255.0f;
 
@@ -89,7 +112,16 @@ Vector3f OrenNayarShader::shade(const Vector3f &colour, const Vector3f &pos, con
     // View direction
     v = (view_pos - pos).normalized();
 
-    for (Light light : lights) {
+    for (int i = 0; i < num_lights; i++) {
+        const Light &light = lights[i];
+
+        // Out of range
+        float attenuation = light.get_attenuation(pos);
+        if (attenuation == 0.0f) {
+            continue;
+        }
+        Vector3f intensity = attenuation * light.get_intensity();
+
         // Light direction
         l = (light.get_position() - pos).normalized();
 
@@ -109,9 +141,9 @@ Vector3f OrenNayarShader::shade(const Vector3f &colour, const Vector3f &pos, con
 
         diffuse_factor = this->albedo * std::max(0.0f, n_dot_l) * (A + B * s /t) / M_PI;
 
-        output_colour += scaled_colour.cwiseProduct(light.get_intensity()) * diffuse_factor;
+        output_colour += scaled_colour.cwiseProduct(intensity) * diffuse_factor;
     }
-    output_colour /= lights.size();
+    output_colour /= num_scene_lights;
 
     // Clamp the colour between [0, 1]
     output_colour.cwiseMin(1.0f).cwiseMax(0.0f);
@@ -119,7 +151,8 @@ Vector3f OrenNayarShader::shade(const Vector3f &colour, const Vector3f &pos, con
     return output_colour * 255.0f;
 }
 
-Vector3f ToonShader::shade(const Vector3f &colour, const Vector3f &pos, const std::vector<Light> &lights, const Vector3f &view_pos, const Vector3f &normal) {
+Vector3f ToonShader::shade(const Vector3f &colour, const Vector3f &pos, const Light *lights, const int num_lights, const int num_scene_lights, 
+                           const Vector3f &view_pos, const Vector3f &normal) {
     Vector3f l, B_D;
 
     // Scale the input colour between [0, 1]
@@ -129,7 +162,16 @@ Vector3f ToonShader::shade(const Vector3f &colour, const Vector3f &pos, const st
 
     float n_dot_l, c;
 
-    for (Light light : lights) {
+    for (int i = 0; i < num_lights; i++) {
+        const Light &light = lights[i];
+
+        // Out of range
+        float attenuation = light.get_attenuation(pos);
+        if (attenuation == 0.0f) {
+            continue;
+        }
+        Vector3f intensity = attenuation * light.get_intensity();
+
         // Light direction
         l = (light.get_position() - pos).normalized();
 
@@ -143,9 +185,9 @@ Vector3f ToonShader::shade(const Vector3f &colour, const Vector3f &pos, const st
             c = 0.4f;
         }
 
-        output_colour += c * scaled_colour.cwiseProduct(light.get_intensity());
+        output_colour += c * scaled_colour.cwiseProduct(intensity);
     }
-    output_colour /= lights.size();
+    output_colour /= num_scene_lights;
 
     // Clamp the colour between [0, 1]
     output_colour.cwiseMin(1.0f).cwiseMax(0.0f);
@@ -153,7 +195,41 @@ Vector3f ToonShader::shade(const Vector3f &colour, const Vector3f &pos, const st
     return output_colour * 255.0f;
 }
 
-Vector3f NormalShader::shade(const Vector3f &colour, const Vector3f &pos, const std::vector<Light> &lights, const Vector3f &view_pos, const Vector3f &normal) {
+Vector3f NormalShader::shade(const Vector3f &colour, const Vector3f &pos, const Light *lights, const int num_lights, const int num_scene_lights, 
+                             const Vector3f &view_pos, const Vector3f &normal) {
     // Convert normal vector from [-1, 1] range to [0, 1] range and then to [0, 255] rnage
     return 255.0f * ((normal.array() + 1.0f) / 2);
-}
\ No newline at end of file
+}
+
+ShadingTable::ShadingTable(Shader *shader, const std::vector<Light> &lights, const Vector3f &view_pos, const Vector3f &pos) {
+    this->factors.resize(size * size);
+    this->offsets.resize(size * size);
+
+    Vector3f black = Vector3f::Zero();
+    Vector3f white = Vector3f(255.0f, 255.0f, 255.0f);
+
+    Parallel::parallel_for(0, size, 16, [&](int begin, int end) {
+        Vector3f normal, offset;
+        Vector2f xy;
+
+        for (int iy = begin; iy < end; iy++) {
+            for (int ix = 0; ix < size; ix++) {
+                // Normal of the entry. Entries outside the unit disc use the closest normal on its edge
+                xy = Vector2f(2.0f * ix / (size - 1) - 1.0f, 2.0f * iy / (size - 1) - 1.0f);
+                if (xy.squaredNorm() > 1.0f) {
+                    xy.normalize();
+                }
+                normal = Vector3f(xy.x(), xy.y(), std::sqrt(std::max(1.0f - xy.squaredNorm(), 0.0f)));
+
+                // Shading is affine in the colour, so two evaluations recover the factor and offset
+                offset = shader->shade(black, pos, lights, view_pos, normal);
+                this->offsets[iy * size + ix] = offset;
+                this->factors[iy * size + ix] = (shader->shade(white, pos, lights, view_pos, normal) - offset) / 255.0f;
+            }
+        }
+    });
+}
+
+void ShadingTable::shade(const float *colours, const float *normals, const int n, float *shaded) const {
+    Simd::get().shade_table(colours, normals, n, this->factors.data()->data(), this->offsets.data()->data(), size, shaded);
+}
@@ -0,0 +1,217 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+
+#include "simd.hpp"
+#include "parameters.hpp"
+
+namespace {
+    // Kernels used by the image operations. Picked on first use unless selected explicitly
+    std::atomic<const Simd::KernelTable *> selected(nullptr);
+
+    /**
+     * Kernel run by the benchmark. Writes its result to output
+    */
+    struct BenchmarkKernel {
+        const char *name;
+        std::function<void(const Simd::KernelTable &, std::vector<float> &)> run;
+    };
+
+    /**
+     * @param kernels: Kernels to time
+     * @param kernel: Benchmark to run
+     * @param output: Output of the last run
+     *
+     * @return: Fastest of several runs in milliseconds
+    */
+    double time_kernel(const Simd::KernelTable &kernels, const BenchmarkKernel &kernel, std::vector<float> &output) {
+        double best = 0.0;
+        for (int run = 0; run < 5; run++) {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            kernel.run(kernels, output);
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+            if (run == 0 || elapsed.count() < best) {
+                best = elapsed.count();
+            }
+        }
+        return best;
+    }
+}
+
+namespace Simd {
+    std::vector<const KernelTable *> get_available() {
+        std::vector<const KernelTable *> available = {get_baseline_kernels()};
+
+        #if defined(__x86_64__) || defined(__i386__)
+            __builtin_cpu_init();
+            if (get_sse42_kernels() != nullptr && __builtin_cpu_supports("sse4.2")) {
+                available.push_back(get_sse42_kernels());
+            }
+            if (get_avx2_kernels() != nullptr && __builtin_cpu_supports("avx2")) {
+                available.push_back(get_avx2_kernels());
+            }
+            if (get_avx512_kernels() != nullptr && __builtin_cpu_supports("avx512f")) {
+                available.push_back(get_avx512_kernels());
+            }
+        #endif
+        return available;
+    }
+
+    void select(const std::string &name) {
+        std::vector<const KernelTable *> available = get_available();
+
+        if (name == "auto") {
+            selected = available.back();
+            return;
+        }
+        for (const KernelTable *kernels : available) {
+            if (name == kernels->name) {
+                selected = kernels;
+                return;
+            }
+        }
+        if (name == "baseline" || name == "sse4.2" || name == "avx2" || name == "avx512") {
+            throw std::invalid_argument("Unable to select kernels: " + name + " is not supported by this CPU or build.");
+        }
+        throw std::invalid_argument("Unable to select kernels: unknown variant " + name + ".");
+    }
+
+    const KernelTable &get() {
+        const KernelTable *kernels = selected;
+        if (kernels == nullptr) {
+            // Concurrent first calls pick the same variant
+            kernels = get_available().back();
+            selected = kernels;
+        }
+        return *kernels;
+    }
+
+    bool benchmark() {
+        const int width = 1024, height = 1024, num_pixels = width * height;
+        const int table_size = 256;
+
+        // Synthetic inputs with a fixed seed, so every variant sees the same data
+        std::mt19937 random(42);
+        std::uniform_real_distribution<float> colour(0.0f, 255.0f);
+        std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+        std::vector<float> pixels(3 * num_pixels), compare(3 * num_pixels), gray(num_pixels);
+        std::vector<float> alphas(num_pixels), opacities(num_pixels), stroke_heights(num_pixels), heights(num_pixels);
+        std::vector<float> factors(3 * table_size * table_size), offsets(3 * table_size * table_size);
+        auto fill = [&](std::vector<float> &values, std::uniform_real_distribution<float> &distribution) {
+            for (float &value : values) {
+                value = distribution(random);
+            }
+        };
+        fill(pixels, colour);
+        fill(compare, colour);
+        fill(gray, colour);
+        fill(alphas, unit);
+        fill(opacities, colour);
+        fill(stroke_heights, colour);
+        fill(heights, colour);
+        fill(factors, unit);
+        fill(offsets, colour);
+
+        // Unit gradients with magnitude 1, and a zero gradient (magnitude 0) every 16th pixel
+        std::vector<float> gradients(3 * num_pixels);
+        for (int i = 0; i < num_pixels; i++) {
+            float angle = 6.2831853f * unit(random);
+            bool zero = i % 16 == 0;
+            gradients[3 * i] = zero ? 0.0f : std::cos(angle);
+            gradients[3 * i + 1] = zero ? 0.0f : std::sin(angle);
+            gradients[3 * i + 2] = zero ? 0.0f : 1.0f;
+        }
+
+        // Stroke seeds
+        const int num_seeds = 16384;
+        std::vector<int> seeds_x(num_seeds), seeds_y(num_seeds);
+        std::uniform_int_distribution<int> seed_x(0, width - 1), seed_y(0, height - 1);
+        for (int i = 0; i < num_seeds; i++) {
+            seeds_x[i] = seed_x(random);
+            seeds_y[i] = seed_y(random);
+        }
+
+        const float sobel_x[9] = {1, 0, -1, 2, 0, -2, 1, 0, -1};
+        const float sobel_y[9] = {1, 2, 1, 0, 0, 0, -1, -2, -1};
+        const float stroke_colour[3] = {200.0f, 120.0f, 40.0f};
+
+        // Normals for the shading table, computed with the baseline kernels
+        std::vector<float> normals(3 * num_pixels);
+        for (int x = 0; x < width; x++) {
+            get_baseline_kernels()->sobel_normals(gray.data(), width, height, sobel_x, sobel_y, x, 0, height, normals.data() + 3 * x * height);
+        }
+
+        std::vector<BenchmarkKernel> benchmarks = {
+            {"blur (5x5 axpy)", [&](const KernelTable &kernels, std::vector<float> &output) {
+                // Column by column, like RGBImage::gaussian_blur
+                output.assign(3 * num_pixels, 0.0f);
+                for (int x = 0; x < width; x++) {
+                    for (int tap = 0; tap < 25; tap++) {
+                        int source_x = std::min(std::max(x + tap % 5 - 2, 0), width - 1);
+                        kernels.axpy(output.data() + 3 * x * height, pixels.data() + 3 * (source_x * height + tap / 5), 
+                            0.04f * (tap + 1), 3 * (height - 4));
+                    }
+                }
+            }},
+            {"difference/luminosity", [&](const KernelTable &kernels, std::vector<float> &output) {
+                output.resize(2 * num_pixels);
+                kernels.difference_luminosity(pixels.data(), compare.data(), output.data(), output.data() + num_pixels, num_pixels);
+            }},
+            {"gradient normals", [&](const KernelTable &kernels, std::vector<float> &output) {
+                output.resize(3 * num_pixels);
+                for (int x = 0; x < width; x++) {
+                    kernels.sobel_normals(gray.data(), width, height, sobel_x, sobel_y, x, 0, height, output.data() + 3 * x * height);
+                }
+            }},
+            {"shading table", [&](const KernelTable &kernels, std::vector<float> &output) {
+                output.resize(3 * num_pixels);
+                kernels.shade_table(pixels.data(), normals.data(), num_pixels, factors.data(), offsets.data(), table_size, output.data());
+            }},
+            {"stroke compositing", [&](const KernelTable &kernels, std::vector<float> &output) {
+                output.assign(pixels.begin(), pixels.end());
+                output.insert(output.end(), heights.begin(), heights.end());
+                kernels.composite(stroke_colour, 0.5f, alphas.data(), opacities.data(), stroke_heights.data(), output.data(),
+                    output.data() + 3 * num_pixels, num_pixels);
+            }},
+            {"stroke tracing", [&](const KernelTable &kernels, std::vector<float> &output) {
+                // Control points followed by the number of points of each stroke
+                const int max_points = ProgramParameters::max_stroke_length * num_seeds;
+                std::vector<int> num_points(num_seeds);
+                output.assign(2 * max_points + num_seeds, 0.0f);
+                kernels.trace_strokes(pixels.data(), compare.data(), gradients.data(), width, height, 8, seeds_x.data(), seeds_y.data(), 
+                    num_seeds, output.data(), output.data() + max_points, num_points.data());
+                std::copy(num_points.begin(), num_points.end(), output.begin() + 2 * max_points);
+            }}
+        };
+
+        std::vector<const KernelTable *> available = get_available();
+        bool all_match = true;
+
+        std::cout << "Kernel benchmark (" << width << "x" << height << ", best of 5 runs)" << std::endl;
+        for (const BenchmarkKernel &kernel : benchmarks) {
+            std::vector<float> reference, output;
+            double baseline_ms = time_kernel(*available[0], kernel, reference);
+
+            for (const KernelTable *kernels : available) {
+                double ms = kernels == available[0] ? baseline_ms : time_kernel(*kernels, kernel, output);
+                bool match = kernels == available[0] ||
+                    (output.size() == reference.size() && std::memcmp(output.data(), reference.data(), output.size() * sizeof(float)) == 0);
+                all_match = all_match && match;
+
+                std::cout << "  " << std::left << std::setw(24) << kernel.name << std::setw(10) << kernels->name << std::right <<
+                    std::fixed << std::setprecision(2) << std::setw(9) << ms << " ms" << std::setw(8) << baseline_ms / ms << "x  " <<
+                    (match ? "identical" : "MISMATCH") << std::endl;
+            }
+        }
+        std::cout << "Selected kernels: " << get().name << std::endl;
+        return all_match;
+    }
+}
@@ -0,0 +1,17 @@
+// AVX2 variant of the kernels. Compiled with -mavx2 (see CMakeLists.txt)
+#include "simd.hpp"
+
+#if defined(__AVX2__)
+    #include "simd_kernels.inc"
+#endif
+
+namespace Simd {
+    const KernelTable *get_avx2_kernels() {
+        #if defined(__AVX2__)
+            static const KernelTable kernels = make_kernel_table("avx2");
+            return &kernels;
+        #else
+            return nullptr;
+        #endif
+    }
+}
@@ -0,0 +1,17 @@
+// AVX-512 variant of the kernels. Compiled with -mavx512f (see CMakeLists.txt)
+#include "simd.hpp"
+
+#if defined(__AVX512F__)
+    #include "simd_kernels.inc"
+#endif
+
+namespace Simd {
+    const KernelTable *get_avx512_kernels() {
+        #if defined(__AVX512F__)
+            static const KernelTable kernels = make_kernel_table("avx512");
+            return &kernels;
+        #else
+            return nullptr;
+        #endif
+    }
+}
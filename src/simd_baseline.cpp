@@ -0,0 +1,10 @@
+// Baseline (SSE2 on x86-64) variant of the kernels. Compiled with the default flags
+#include "simd.hpp"
+#include "simd_kernels.inc"
+
+namespace Simd {
+    const KernelTable *get_baseline_kernels() {
+        static const KernelTable kernels = make_kernel_table("baseline");
+        return &kernels;
+    }
+}
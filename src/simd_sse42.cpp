@@ -0,0 +1,17 @@
+// SSE4.2 variant of the kernels. Compiled with -msse4.2 (see CMakeLists.txt)
+#include "simd.hpp"
+
+#if defined(__SSE4_2__)
+    #include "simd_kernels.inc"
+#endif
+
+namespace Simd {
+    const KernelTable *get_sse42_kernels() {
+        #if defined(__SSE4_2__)
+            static const KernelTable kernels = make_kernel_table("sse4.2");
+            return &kernels;
+        #else
+            return nullptr;
+        #endif
+    }
+}
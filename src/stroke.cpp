@@ -1,7 +1,12 @@
+#include <algorithm>
+#include <numeric>
+#include <random>
+
 #include "stroke.hpp"
 #include "parameters.hpp"
+#include "simd.hpp"
 
-Stroke::Stroke(int x0, int y0, int radius, RGBImage *ref_image, RGBImage *canvas, GrayImage *luminosity, Texture *height_texture, Texture *opacity_texture) {
+Stroke::Stroke(int x0, int y0, int radius, RGBImage *ref_image, RGBImage *canvas, const VectorMatrix *gradients, const TextureSampler *sampler) {
     Vector2f d, g, last;
     Vector3f ref_pixel, canvas_pixel, new_pixel;
     float grad_mag;
@@ -15,10 +20,6 @@ Stroke::Stroke(int x0, int y0, int radius, RGBImage *ref_image, RGBImage *canvas
     // Add first control point
     this->control_points.push_back(Vector2f(x, y));
 
-    // Sobel kernels used to compute image gradient
-    HorizontalSobelKernel sobel_x = HorizontalSobelKernel::get_instance();
-    VerticalSobelKernel sobel_y = VerticalSobelKernel::get_instance();
-
     d = Vector2f::Zero();
     last = Vector2f::Zero();
 
@@ -29,12 +30,14 @@ Stroke::Stroke(int x0, int y0, int radius, RGBImage *ref_image, RGBImage *canvas
         ref_pixel = ref_image->get_pixel(x, y);
         canvas_pixel = canvas->get_pixel(x, y);
         
-        // Get the unit vector of gradient (gx, gy) and gradient magnitutde
-        std::tie<Vector2f, float>(g, grad_mag) = luminosity->compute_gradient(x, y, &sobel_x, &sobel_y);
+        // Get the unit vector of gradient (gx, gy) and gradient magnitutde. Eigen uses (row, col) indicies
+        const Vector3f &gradient = (*gradients)((int) y, (int) x);
+        g = Vector2f(gradient.x(), gradient.y());
+        grad_mag = gradient.z();
         
         // Gradient is too small
         if (length * grad_mag < 1) {
-            return;
+            break;
         }
 
         // Compute normal direction
@@ -60,164 +63,163 @@ Stroke::Stroke(int x0, int y0, int radius, RGBImage *ref_image, RGBImage *canvas
 
         // Ensure the control point is valid
         if (x < 0 || x >= ref_image->get_width() || y < 0 || y >= ref_image->get_height()) {
-            return;
+            break;
         }
 
         new_pixel = ref_image->get_pixel(x, y);
 
+        // Squared distances avoid two square roots and preserve the comparison
         if (i >= ProgramParameters::min_stroke_length && 
-            (ref_pixel - canvas_pixel).norm() < (this->colour - new_pixel).norm()) {
-            return;
+            (ref_pixel - canvas_pixel).squaredNorm() < (this->colour - new_pixel).squaredNorm()) {
+            break;
         }
 
         // Add the new control point
         this->control_points.push_back(Vector2f(x, y));
     }
 
-    this->height_texture = height_texture;
-    this->opacity_texture = opacity_texture;
+    this->compute_segment_steps();
+
+    // Every stroke is textured, regardless of why tracing stopped
+    this->sampler = sampler;
     this->compute_bounding_box(ref_image->get_width(), ref_image->get_height());
+    this->compute_texture_mapping();
 }
 
-bool Stroke::limit_is_done() {
-    if (this->limit.size() < 3) {
-        return true;
+Stroke::Stroke(const Vector2f *control_points, int num_points, int radius, Vector3f colour, int width, int height, const TextureSampler *sampler) {
+    if (num_points < 1 || num_points > ProgramParameters::max_stroke_length) {
+        throw std::invalid_argument("Unable to create stroke: invalid number of control points.");
     }
 
-    // Difference between the second and first points in the limit 
-    Vector2f d = this->limit[1] - this->limit[0];
-
-    // Angle between the second and first point in the limit
-    float last_theta = std::atan2(d.y(), d.x());
-
-    float new_theta;
-    float t_diff;
-
-    for (int i = 2; i < this->limit.size(); i++) {
-        // Difference between the current and previous point in the limit
-        d = limit[i] - limit[i - 1];
+    this->colour = colour;
+    this->radius = radius;
+    this->control_points.assign(control_points, control_points + num_points);
 
-        // Angle between the current and previous point in the limit
-        new_theta = std::atan2(d.y(), d.x());
+    this->compute_segment_steps();
 
-        // Difference between the current and last angle (in radians)
-        t_diff = std::fmod(std::abs(new_theta - last_theta), M_PI);
+    this->sampler = sampler;
+    this->compute_bounding_box(width, height);
+    this->compute_texture_mapping();
+}
 
-        // Ensures that the distance between the points and the angle between the points
-        // is small enough
-        if ((d.x() >= this->neighbourhood || d.y() >= this->neighbourhood) && t_diff > this->theta_tol) {
-            return false;
+void Stroke::trace(const Vector2i *seeds, int n, int radius, RGBImage *ref_image, RGBImage *canvas, const VectorMatrix *gradients, 
+                   const TextureSampler *sampler, Stroke *strokes) {
+    #if defined(PRECISION_UINT8) || defined(PRECISION_UINT16)
+        // The batched tracer reads single precision pixels
+        for (int s = 0; s < n; s++) {
+            strokes[s] = Stroke(seeds[s].x(), seeds[s].y(), radius, ref_image, canvas, gradients, sampler);
+        }
+    #else
+        int width = ref_image->get_width(), height = ref_image->get_height();
+        // Distance between control points
+        int length = radius * ProgramParameters::length_fac;
+
+        std::vector<int> seeds_x(n), seeds_y(n), num_points(n);
+        for (int s = 0; s < n; s++) {
+            seeds_x[s] = seeds[s].x();
+            seeds_y[s] = seeds[s].y();
         }
 
-        last_theta = new_theta;
-    }
-
-    // Clean out extra points from the limit curve
-
-    std::vector<Vector2f> pts;
-    
-    pts.push_back(this->limit[0]);
-
-    Vector2f last_pt = this->limit[0];
-
-    Vector2f current_pt, next_pt;
-
-    for (int i = 1; i < this->limit.size() - 1; i++) {
-        current_pt = this->limit[i];
-        next_pt = this->limit[i + 1];
-
-        last_theta = std::atan2(current_pt.y() - last_pt.y(), current_pt.x() - last_pt.x());
-        new_theta = std::atan2(next_pt.y() - current_pt.y(), next_pt.x() - current_pt.x());
+        std::vector<float> points_x(ProgramParameters::max_stroke_length * n), points_y(ProgramParameters::max_stroke_length * n);
+        Simd::get().trace_strokes(ref_image->get_image()->data()->data(), canvas->get_image()->data()->data(), 
+            gradients->data()->data(), width, height, length, seeds_x.data(), seeds_y.data(), n, points_x.data(), points_y.data(), 
+            num_points.data());
 
-        t_diff = std::fmod(std::abs(new_theta - last_theta), M_PI);
+        Vector2f control_points[ProgramParameters::max_stroke_length];
+        for (int s = 0; s < n; s++) {
+            for (int i = 0; i < num_points[s]; i++) {
+                control_points[i] = Vector2f(points_x[i * n + s], points_y[i * n + s]);
+            }
+            strokes[s] = Stroke(control_points, num_points[s], radius, ref_image->get_pixel(seeds[s].x(), seeds[s].y()), width, height, sampler);
+        }
+    #endif
+}
 
-        if (t_diff > this->theta_tol) {
-            pts.push_back(current_pt);
+Vector2f Stroke::get_control_point(const int i) const {
+    int len = this->control_points.size();
 
-            last_pt = current_pt;
-        }
+    // Reflect the neighbouring control point about the end points
+    if (i < 0) {
+        return 2 * this->control_points[0] - this->control_points[1];
     }
-
-    if (!clean || pts.size() == this->limit.size() - 1) {
-        return true;
+    if (i >= len) {
+        return 2 * this->control_points[len - 1] - this->control_points[len - 2];
     }
-
-    pts.push_back(this->limit[this->limit.size() - 1]);
-
-    // Free old limit vector
-    this->limit.clear();
-    this->limit.shrink_to_fit();
-
-    this->limit = pts;
-    return true;
+    return this->control_points[i];
 }
 
-void Stroke::compute_limit_curve() {
-    std::vector<Vector2f> split;
-    int split_len;
-
-    this->limit = this->control_points;
-
-    // Continue interpolating points until the limit is complete
-    while (!this->limit_is_done()) {
-        split_len = 2 * this->limit.size() - 1;
-        split.resize(split_len);
-
-        for (int i = 0; i < split_len; i++) {
-            if (i % 2 == 0) {
-                split[i] = this->limit[i / 2];
-            } 
-            else {
-                split[i] = 0.5 * this->limit[i / 2] + this->limit[(i / 2) + 1];
-            }
-        }
-
-        this->limit.resize(split_len);
+void Stroke::compute_segment_steps() {
+    int len = this->control_points.size();
+    Vector2f p0, p1, p2, p3;
+    float curvature;
 
-        this->limit[0] = split[0];
-        this->limit[split_len - 1] = split[split_len - 1];
-        
-        // Interpolate the values in split
-        for (int i = 1; i < split_len - 1; i++) {
-            this->limit[i] = 0.25 * split[i - 1] + 0.5 * split[i] + 0.25 * split[i + 1];
-        }
+    if (len == 1) {
+        this->limit_size = 1;
+        return;
     }
-}
 
-Vector2f Stroke::get_uv_coords(const int x, const int y) const {
-    // Compute the width and height of the stroke bounding box
-    int width = this->top_right.x() - this->bottom_left.x();
-    int height = this->top_right.y() - this->bottom_left.y();
+    this->limit_size = 1;
+    for (int i = 0; i < len - 1; i++) {
+        p0 = this->get_control_point(i - 1);
+        p1 = this->control_points[i];
+        p2 = this->control_points[i + 1];
+        p3 = this->get_control_point(i + 2);
 
-    // Default u and v values (for invalid dimensions)
-    float u = 0.5f;
-    float v = 0.5f;
+        // The second derivative of the segment is bounded by the second differences of its 
+        // control points. Linear interpolation with n steps deviates by at most curvature / (8 n^2)
+        curvature = std::max((p0 - 2 * p1 + p2).norm(), (p1 - 2 * p2 + p3).norm());
 
-    if (width != 0) {
-        u = (x - this->bottom_left.x()) / width;
+        this->segment_steps[i] = std::max((int) std::ceil(std::sqrt(curvature / (8 * this->flatness_tol))), 1);
+        this->limit_size += this->segment_steps[i];
     }
+}
 
-    if (height != 0) {
-        v = (y - this->bottom_left.y()) / height;
+void Stroke::compute_limit(Vector2f *limit) const {
+    int len = this->control_points.size();
+    Vector2f p0, p1, p2, p3;
+    float t, t2, t3, s;
+    int steps, n = 0;
+
+    limit[n++] = this->control_points[0];
+
+    for (int i = 0; i < len - 1; i++) {
+        p0 = this->get_control_point(i - 1);
+        p1 = this->control_points[i];
+        p2 = this->control_points[i + 1];
+        p3 = this->get_control_point(i + 2);
+
+        steps = this->segment_steps[i];
+        for (int k = 1; k <= steps; k++) {
+            t = (float) k / steps;
+            t2 = t * t;
+            t3 = t2 * t;
+            s = 1 - t;
+
+            // Uniform cubic b-spline basis functions
+            limit[n++] = (
+                s * s * s * p0 + 
+                (3 * t3 - 6 * t2 + 4) * p1 + 
+                (-3 * t3 + 3 * t2 + 3 * t + 1) * p2 + 
+                t3 * p3
+            ) / 6.0f;
+        }
     }
-
-    return Vector2f(u, v);
 }
 
 void Stroke::compute_bounding_box(const int width, const int height) {
     int len = this->control_points.size();
 
     // Smallest and largest x-coordinates
-    int x_min = width;
+    int x_min = width - 1;
     int x_max = 0;
     // Smallest and largest y-coordiantes
-    int y_min = height;
+    int y_min = height - 1;
     int y_max = 0;
 
     int current_x_min, current_x_max, current_y_min, current_y_max;
-    for (int i = 1; i < len; i++) {
+    for (int i = 0; i < len; i++) {
         current_x_min = std::max((int) this->control_points[i].x() - this->radius, 0);
-        current_x_max = std::max((int) this->control_points[i].x() + this->radius, width - 1);
+        current_x_max = std::min((int) this->control_points[i].x() + this->radius, width - 1);
 
         if (current_x_min < x_min) {
             x_min = current_x_min;
@@ -226,7 +228,7 @@ void Stroke::compute_bounding_box(const int width, const int height) {
             x_max = current_x_max;
         }
 
-        current_y_min = std::min((int) this->control_points[i].y() - this->radius, 0);
+        current_y_min = std::max((int) this->control_points[i].y() - this->radius, 0);
         current_y_max = std::min((int) this->control_points[i].y() + this->radius, height - 1);
 
         if (current_y_min < y_min) {
@@ -241,28 +243,154 @@ void Stroke::compute_bounding_box(const int width, const int height) {
     this->top_right = Vector2i(x_max, y_max);
 }
 
-float Stroke::get_height(const int x, const int y) const {
-    // Default (constant height)
-    if (this->height_texture == nullptr) {
-        return 1.0f;
+void Stroke::compute_texture_mapping() {
+    if (this->sampler == nullptr) {
+        return;
+    }
+
+    // Compute the width and height of the stroke bounding box
+    int width = this->top_right.x() - this->bottom_left.x();
+    int height = this->top_right.y() - this->bottom_left.y();
+
+    this->mip_level = this->sampler->select_level(width + 1, height + 1);
+
+    int texels_x = this->sampler->get_width(this->mip_level) - 1;
+    int texels_y = this->sampler->get_height(this->mip_level) - 1;
+
+    // Map the bounding box onto the whole texture. Invalid dimensions sample the centre of the texture
+    if (width != 0) {
+        this->texel_origin_x = 0;
+        this->texel_step_x = (static_cast<int64_t>(texels_x) << 16) / width;
+    } 
+    else {
+        this->texel_origin_x = (texels_x << TextureSampler::frac_bits) / 2;
+        this->texel_step_x = 0;
+    }
+
+    if (height != 0) {
+        this->texel_origin_y = 0;
+        this->texel_step_y = (static_cast<int64_t>(texels_y) << 16) / height;
+    } 
+    else {
+        this->texel_origin_y = (texels_y << TextureSampler::frac_bits) / 2;
+        this->texel_step_y = 0;
+    }
+}
+
+TextureSample Stroke::get_texture_sample(const int x, const int y) const {
+    // Default (constant height and opacity)
+    if (this->sampler == nullptr) {
+        return TextureSample {1.0f, 125.0f};
+    }
+
+    // Convert (x, y) coordinate to fixed-point texel coordinates based on bounding box
+    int tx = this->texel_origin_x + static_cast<int>(((x - this->bottom_left.x()) * this->texel_step_x) >> (16 - TextureSampler::frac_bits));
+    int ty = this->texel_origin_y + static_cast<int>(((y - this->bottom_left.y()) * this->texel_step_y) >> (16 - TextureSampler::frac_bits));
+
+    return this->sampler->sample(this->mip_level, tx, ty);
+}
+
+void StrokeFootprint::begin(const Vector2f *limit, const int limit_size, const Kernel *mask, const int canvas_width, const int canvas_height) {
+    // Bounding box of the limit curve. Points are truncated to integers when rendered
+    float x_min = limit[0].x(), x_max = limit[0].x();
+    float y_min = limit[0].y(), y_max = limit[0].y();
+    for (int i = 1; i < limit_size; i++) {
+        x_min = std::min(x_min, limit[i].x());
+        x_max = std::max(x_max, limit[i].x());
+        y_min = std::min(y_min, limit[i].y());
+        y_max = std::max(y_max, limit[i].y());
     }
 
-    // Convert (x, y) coordinate to (u, v) coordinates based on bounding box
-    Vector2f uv_coords = this->get_uv_coords(x, y);
+    // Lines are rasterized by accumulating their slope in floating point, which can round a 
+    // point one pixel past the end of the line
+    x_min -= 1, y_min -= 1;
+    x_max += 1, y_max += 1;
+
+    // Extend by the brush mask and clip to the canvas
+    this->x0 = std::max((int) std::floor(x_min) - mask->get_centre_x(), 0);
+    this->y0 = std::max((int) std::floor(y_min) - mask->get_centre_y(), 0);
+    this->width = std::max(std::min((int) std::ceil(x_max) + mask->get_len() - mask->get_centre_x(), canvas_width) - this->x0, 0);
+    this->height = std::max(std::min((int) std::ceil(y_max) + mask->get_len() - mask->get_centre_y(), canvas_height) - this->y0, 0);
+
+    // Only grows, so the buffer is only reallocated for the largest stroke seen so far.
+    // New records start stale (epoch 0)
+    if (this->records.size() < (size_t) this->width * this->height) {
+        this->records.resize(this->width * this->height, Record {0, 0.0f, ColourStorage(), TextureSample {0.0f, 0.0f}});
+    }
 
-    // Return the height value from the height texture
-    return this->height_texture->get_texture_value(uv_coords);
+    // Invalidate every record. They are only cleared when the epoch wraps around
+    this->epoch++;
+    if (this->epoch == 0) {
+        for (Record &record : this->records) {
+            record.epoch = 0;
+        }
+        this->epoch = 1;
+    }
 }
 
-float Stroke::get_opacity(const int x, const int y) const {
-    // Default (constant opacity)
-    if (this->opacity_texture == nullptr) {
-        return 125.0f;
+namespace StrokeOrdering {
+    uint32_t morton_key(uint32_t x, uint32_t y) {
+        // Spread the 16 bits of each coordinate over the even bits
+        auto spread = [](uint32_t value) {
+            value &= 0xffff;
+            value = (value | (value << 8)) & 0x00ff00ff;
+            value = (value | (value << 4)) & 0x0f0f0f0f;
+            value = (value | (value << 2)) & 0x33333333;
+            value = (value | (value << 1)) & 0x55555555;
+            return value;
+        };
+        return spread(x) | (spread(y) << 1);
+    }
+
+    uint32_t hilbert_key(uint32_t x, uint32_t y, uint32_t size) {
+        uint32_t key = 0;
+        for (uint32_t s = size / 2; s > 0; s /= 2) {
+            uint32_t rx = (x & s) > 0;
+            uint32_t ry = (y & s) > 0;
+            key += s * s * ((3 * rx) ^ ry);
+
+            // Rotate the quadrant so the curve continues from where the previous quadrant ended
+            if (ry == 0) {
+                if (rx == 1) {
+                    x = size - 1 - x;
+                    y = size - 1 - y;
+                }
+                std::swap(x, y);
+            }
+        }
+        return key;
     }
 
-    // Convert (x, y) coordinate to (u, v) coordinates based on bounding box
-    Vector2f uv_coords = this->get_uv_coords(x, y);
+    std::vector<int> get_order(const std::vector<Stroke> &strokes, StrokeOrder order, int width, int height, uint32_t seed) {
+        std::vector<int> indices(strokes.size());
+        std::iota(indices.begin(), indices.end(), 0);
+
+        if (order == StrokeOrder::RASTER) {
+            return indices;
+        }
+        if (order == StrokeOrder::RANDOM) {
+            std::mt19937 random(seed);
+            std::shuffle(indices.begin(), indices.end(), random);
+            return indices;
+        }
+
+        // Smallest power of two that covers the canvas
+        uint32_t size = 1;
+        while (size < (uint32_t) std::max(width, height)) {
+            size *= 2;
+        }
+
+        std::vector<uint32_t> keys(strokes.size());
+        for (size_t i = 0; i < strokes.size(); i++) {
+            Vector2i centre = (strokes[i].get_bottom_left() + strokes[i].get_top_right()) / 2;
+            uint32_t x = std::min(std::max(centre.x(), 0), width - 1);
+            uint32_t y = std::min(std::max(centre.y(), 0), height - 1);
+            keys[i] = order == StrokeOrder::MORTON ? morton_key(x, y) : hilbert_key(x, y, size);
+        }
 
-    // Return the height value from the height texture
-    return this->opacity_texture->get_texture_value(uv_coords);
-}
\ No newline at end of file
+        std::stable_sort(indices.begin(), indices.end(), [&keys](int a, int b) {
+            return keys[a] < keys[b];
+        });
+        return indices;
+    }
+}
@@ -0,0 +1,107 @@
+#include <algorithm>
+#include <fstream>
+
+#include "strokelist.hpp"
+#include "parameters.hpp"
+
+namespace {
+    // Identifies stroke list files. Bump the version whenever the layout changes
+    const char strokelist_magic[4] = {'F', 'P', 'T', 'S'};
+    const uint32_t strokelist_version = 1;
+}
+
+StrokeList::StrokeList(int width, int height, Vector3f background) {
+    this->width = width;
+    this->height = height;
+    this->background = background;
+}
+
+void StrokeList::add(const Stroke *stroke, const int layer) {
+    const std::vector<Vector2f> &control_points = stroke->get_control_points();
+    Vector3f colour = stroke->get_colour();
+
+    Record record;
+    record.colour[0] = colour.x();
+    record.colour[1] = colour.y();
+    record.colour[2] = colour.z();
+    record.radius = stroke->get_radius();
+    record.first_point = this->points.size();
+    record.num_points = control_points.size();
+    record.layer = layer;
+
+    this->records.push_back(record);
+    this->points.insert(this->points.end(), control_points.begin(), control_points.end());
+}
+
+bool StrokeList::save(const std::string &path) const {
+    std::ofstream file(path, std::ios::binary);
+    if (!file) {
+        return false;
+    }
+
+    Header header;
+    std::copy(strokelist_magic, strokelist_magic + 4, header.magic);
+    header.version = strokelist_version;
+    header.width = this->width;
+    header.height = this->height;
+    header.background[0] = this->background.x();
+    header.background[1] = this->background.y();
+    header.background[2] = this->background.z();
+    header.num_strokes = this->records.size();
+    header.num_points = this->points.size();
+
+    // Vector2f is two tightly packed floats, so the control points are written as they are stored
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char *>(this->records.data()), this->records.size() * sizeof(Record));
+    file.write(reinterpret_cast<const char *>(this->points.data()), this->points.size() * sizeof(Vector2f));
+    return static_cast<bool>(file);
+}
+
+StrokeList *StrokeList::load(const std::string &path) {
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file) {
+        return nullptr;
+    }
+    std::streamoff file_size = file.tellg();
+    file.seekg(0);
+
+    Header header;
+    file.read(reinterpret_cast<char *>(&header), sizeof(header));
+    if (!file || !std::equal(header.magic, header.magic + 4, strokelist_magic) || header.version != strokelist_version ||
+        header.width <= 0 || header.height <= 0) {
+        return nullptr;
+    }
+
+    // The counts are unsigned 32-bit, so the expected size cannot overflow. Checked before anything is allocated, 
+    // so a corrupt header cannot request more memory than the file holds
+    uint64_t expected_size = sizeof(Header) + (uint64_t) header.num_strokes * sizeof(Record) + 
+        (uint64_t) header.num_points * sizeof(Vector2f);
+    if (file_size < 0 || (uint64_t) file_size != expected_size ||
+        header.num_points > (uint64_t) header.num_strokes * ProgramParameters::max_stroke_length) {
+        return nullptr;
+    }
+
+    StrokeList *list = new StrokeList(header.width, header.height,
+        Vector3f(header.background[0], header.background[1], header.background[2]));
+    list->records.resize(header.num_strokes);
+    list->points.resize(header.num_points);
+
+    file.read(reinterpret_cast<char *>(list->records.data()), header.num_strokes * sizeof(Record));
+    file.read(reinterpret_cast<char *>(list->points.data()), header.num_points * sizeof(Vector2f));
+
+    // Read error
+    if (!file) {
+        delete list;
+        return nullptr;
+    }
+
+    // Every stroke must have a valid number of control points inside the list
+    for (const Record &record : list->records) {
+        if (record.num_points == 0 || record.num_points > ProgramParameters::max_stroke_length || record.radius <= 0.0f ||
+            (uint64_t) record.first_point + record.num_points > header.num_points) {
+            delete list;
+            return nullptr;
+        }
+    }
+    return list;
+}
@@ -1,3 +1,6 @@
+#include <algorithm>
+#include <cmath>
+
 #include "texture.hpp"
 
 float Texture::get_texture_value(const Vector2f uv_coords) const {
@@ -7,9 +10,9 @@ float Texture::get_texture_value(const Vector2f uv_coords) const {
 
     // Convert to four integer coordinates
     int x0 = std::floor(x);
-    int x1 = std::min(x0 + 1, this->get_width());
+    int x1 = std::min(x0 + 1, this->get_width() - 1);
     int y0 = std::floor(y);
-    int y1 = std::min(y0 + 1, this->get_height());
+    int y1 = std::min(y0 + 1, this->get_height() - 1);
 
     float bot_left_val  = this->texture->get_pixel(x0, y0);
     float bot_right_val = this->texture->get_pixel(x1, y0);
@@ -27,4 +30,154 @@ float Texture::get_texture_value(const Vector2f uv_coords) const {
 
     // Combines values in the y-direction
     return (1 - cont_y) * combined_bot_value + cont_y * combined_top_value;
-}
\ No newline at end of file
+}
+
+TextureSampler::MipLevel TextureSampler::make_level(const int width, const int height) {
+    MipLevel level;
+    level.width = width;
+    level.height = height;
+    level.tiles_x = (width + tile_size - 1) / tile_size;
+
+    int tiles_y = (height + tile_size - 1) / tile_size;
+    level.texels.resize(level.tiles_x * tiles_y * tile_size * tile_size, 0);
+    return level;
+}
+
+TextureSampler::TextureSampler(const Texture *height_texture, const Texture *opacity_texture) {
+    // Resolution of the finest mip level
+    int width = 1, height = 1;
+    if (height_texture != nullptr) {
+        width = height_texture->get_width();
+        height = height_texture->get_height();
+    } 
+    else if (opacity_texture != nullptr) {
+        width = opacity_texture->get_width();
+        height = opacity_texture->get_height();
+    }
+
+    MipLevel base = make_level(width, height);
+    
+    const GrayImage *height_image = height_texture != nullptr ? height_texture->get_image() : nullptr;
+    const GrayImage *opacity_image = opacity_texture != nullptr ? opacity_texture->get_image() : nullptr;
+    bool resample_opacity = opacity_image != nullptr && 
+        (opacity_image->get_width() != width || opacity_image->get_height() != height);
+
+    float h, o;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            // Default (constant height)
+            h = height_image != nullptr ? height_image->get_pixel(x, y) : 1.0f;
+
+            // Default (constant opacity)
+            if (opacity_image == nullptr) {
+                o = 125.0f;
+            } 
+            else if (resample_opacity) {
+                o = opacity_texture->get_texture_value(Vector2f(
+                    width > 1 ? (float) x / (width - 1) : 0.5f, 
+                    height > 1 ? (float) y / (height - 1) : 0.5f
+                ));
+            } 
+            else {
+                o = opacity_image->get_pixel(x, y);
+            }
+
+            base.texels[tiled_index(base, x, y)] = 
+                static_cast<uint16_t>(std::clamp<int>(std::lround(h), 0, 255)) | 
+                static_cast<uint16_t>(std::clamp<int>(std::lround(o), 0, 255) << 8);
+        }
+    }
+    this->levels.push_back(base);
+
+    // Build the mip chain by averaging 2x2 blocks of texels (clamped at odd edges)
+    while (width > 1 || height > 1) {
+        const MipLevel &prev = this->levels.back();
+        width = std::max(width / 2, 1);
+        height = std::max(height / 2, 1);
+
+        MipLevel level = make_level(width, height);
+        int x0, x1, y0, y1;
+        uint64_t sum;
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                x0 = std::min(2 * x, prev.width - 1);
+                x1 = std::min(2 * x + 1, prev.width - 1);
+                y0 = std::min(2 * y, prev.height - 1);
+                y1 = std::min(2 * y + 1, prev.height - 1);
+
+                // Both channels are averaged at once. Each channel sum fits in 32 bits
+                sum = get_texel(prev, x0, y0) + get_texel(prev, x1, y0) + get_texel(prev, x0, y1) + get_texel(prev, x1, y1);
+                sum += (2ull << 32) | 2ull;
+                level.texels[tiled_index(level, x, y)] = 
+                    static_cast<uint16_t>((sum >> 2) & 0xff) | static_cast<uint16_t>(((sum >> 34) & 0xff) << 8);
+            }
+        }
+        this->levels.push_back(std::move(level));
+    }
+}
+
+int TextureSampler::select_level(const int footprint_width, const int footprint_height) const {
+    // Number of texels covered by a single canvas pixel
+    float texels_per_pixel = std::max(
+        (float) this->levels[0].width / std::max(footprint_width, 1), 
+        (float) this->levels[0].height / std::max(footprint_height, 1)
+    );
+
+    int level = 0;
+    while (texels_per_pixel >= 2.0f && level < this->get_num_levels() - 1) {
+        texels_per_pixel /= 2.0f;
+        level++;
+    }
+    return level;
+}
+
+TextureSample TextureSampler::sample(const int level_index, const int tx, const int ty) const {
+    const MipLevel &level = this->levels[level_index];
+    const int one = 1 << frac_bits;
+
+    // Clamp to the texture
+    int x = std::clamp(tx, 0, (level.width - 1) << frac_bits);
+    int y = std::clamp(ty, 0, (level.height - 1) << frac_bits);
+
+    // Integer texel coordinates and fixed-point contributions
+    int x0 = x >> frac_bits, y0 = y >> frac_bits;
+    int x1 = std::min(x0 + 1, level.width - 1);
+    int y1 = std::min(y0 + 1, level.height - 1);
+    uint64_t cont_x = x & (one - 1);
+    uint64_t cont_y = y & (one - 1);
+
+    // Combines values in the x-direction. Both channels are blended at once
+    uint64_t combined_bot_value = (one - cont_x) * get_texel(level, x0, y0) + cont_x * get_texel(level, x1, y0);
+    uint64_t combined_top_value = (one - cont_x) * get_texel(level, x0, y1) + cont_x * get_texel(level, x1, y1);
+
+    // Combines values in the y-direction
+    uint64_t value = (one - cont_y) * combined_bot_value + cont_y * combined_top_value;
+
+    const float scale = 1.0f / (one * one);
+    return TextureSample {
+        static_cast<float>(value & 0xffffffffull) * scale, 
+        static_cast<float>(value >> 32) * scale
+    };
+}
+
+BrushTextures::BrushTextures(Texture *height_texture, Texture *opacity_texture) {
+    this->height_texture = height_texture;
+    this->opacity_texture = opacity_texture;
+    this->sampler = new TextureSampler(height_texture, opacity_texture);
+}
+
+std::shared_ptr<const BrushTextures> BrushTextures::load(const std::string &directory) {
+    cv::Mat height_image = cv::imread(directory + "height.png", cv::IMREAD_GRAYSCALE);
+    if (height_image.empty()) {
+        throw std::invalid_argument("Unable to load brush textures: could not open " + directory + "height.png");
+    }
+    cv::Mat opacity_image = cv::imread(directory + "opacity.png", cv::IMREAD_GRAYSCALE);
+    if (opacity_image.empty()) {
+        throw std::invalid_argument("Unable to load brush textures: could not open " + directory + "opacity.png");
+    }
+
+    return std::make_shared<const BrushTextures>(
+        new Texture(height_image.cols, height_image.rows, height_image),
+        new Texture(opacity_image.cols, opacity_image.rows, opacity_image)
+    );
+}